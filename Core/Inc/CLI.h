@@ -17,16 +17,69 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+
+// Command handler results
+#define CLI_OK				0
+#define CLI_ERROR			(-1)	// Handler has reported the problem
+#define CLI_ERROR_ARGS		(-2)	// Bad arguments, show the usage
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Command handler, argv[0] is the command name
+typedef int (*clifunc)(int argc, char *argv[]);
+
+// What to do when txBuffer has no room for output
+typedef enum
+{
+	OUTPUT_POLICY_DROP,		// Discard and count the bytes
+	OUTPUT_POLICY_BLOCK,	// Wait for the UART to make room
+	OUTPUT_POLICY_ASYNC,	// As BLOCK, but producers run in steps from CLI_Update()
+} OutputPolicy;
+
+typedef struct
+{
+	uint32_t	droppedBytes;
+	uint32_t	droppedWrites;
+	uint32_t	stalls;			// Writes that had to wait for space
+	uint32_t	highWater;		// Most bytes queued in txBuffer
+} TxStats_t;
+
+typedef struct
+{
+	uint32_t	typed;			// Characters typed into the host by type-through
+	uint32_t	skipped;		// Characters with no key to type them
+	uint32_t	xoffs;			// Times the host was told to stop
+	uint32_t	overruns;		// Bytes lost with rxBuffer full
+} TypeStats_t;
+
+// Generates one step (about a line) of a long output, returns true when done
+typedef bool (*OutputProducer)(uint32_t step);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Public Function declarations
 ///////////////////////////////////////////////////////////////////////////////
 
 void Output(const char *format, ...);
+bool SendData(const char *data, uint32_t length);
 void OutputAt(int x, int y, const char *format, ...);
 void Prompt(void);
 void CLI_ProcessNewData(uint8_t data);
 void CLI_Update(void);
 void CLI_Init(void);
-void Message(const char *text);
+void Message(const char *format, ...);
+void CLI_SetOutputPolicy(OutputPolicy policy);
+OutputPolicy CLI_GetOutputPolicy(void);
+const TxStats_t *CLI_GetTxStats(void);
+const TypeStats_t *CLI_GetTypeStats(void);
+void CLI_StopTyping(void);
+bool CLI_StartProducer(OutputProducer producer);
+bool CLI_ParseInt(const char *text, int32_t min, int32_t max, int32_t *value);
+bool CLI_ParseBool(const char *text, bool *value);
+int  CLI_ParseChoice(const char *text, const char * const choices[], int count);
 
 #endif // INC_CLI_H_
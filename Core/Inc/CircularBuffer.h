@@ -28,8 +28,8 @@
 ///////////////////////////////////////////////////////////////////////////////
 typedef struct
 {
-    uint32_t writeIndex;
-    uint32_t readIndex;
+    volatile uint32_t writeIndex;   // Updated by the writer only
+    volatile uint32_t readIndex;    // Updated by the reader only
     uint32_t maxItems;
     uint8_t * items;
 } CircularBuffer_t;
@@ -42,5 +42,10 @@ void CircularBuffer_DeInit(CircularBuffer_t* buffer);
 bool CircularBuffer_WriteByte(CircularBuffer_t* buffer, uint8_t b);
 bool CircularBuffer_ReadByte(CircularBuffer_t* buffer, uint8_t* b);
 uint32_t CircularBuffer_StoredItems(CircularBuffer_t* buffer);
+uint32_t CircularBuffer_FreeItems(CircularBuffer_t* buffer);
+void CircularBuffer_Poke(CircularBuffer_t* buffer, uint32_t offset, uint8_t b);
+void CircularBuffer_Commit(CircularBuffer_t* buffer, uint32_t count);
+uint32_t CircularBuffer_ContiguousItems(CircularBuffer_t* buffer, uint8_t** data);
+void CircularBuffer_Skip(CircularBuffer_t* buffer, uint32_t count);
 
 #endif // CIRCULARBUFFER_H_
@@ -0,0 +1,31 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Cobs.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for Consistent Overhead Byte Stuffing
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef COBS_H_
+#define COBS_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+
+// Worst case encoded size of length bytes
+#define COBS_MAX_ENCODED(length)	((length) + ((length) / 254) + 1)
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+uint32_t Cobs_Encode(const uint8_t *src, uint32_t length, uint8_t *dst);
+int32_t  Cobs_Decode(const uint8_t *src, uint32_t length, uint8_t *dst);
+
+#endif // COBS_H_
@@ -0,0 +1,92 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Coroutine.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Stackless coroutines, in the style of protothreads
+///
+///             A coroutine is a function that returns CR_WAITING when it has
+///             to wait and is simply called again later. The switch statement
+///             jumps back to the line it stopped on, so :
+///
+///               - local variables do not survive a wait, keep them in the
+///                 coroutine's own state structure
+///               - CR_xxx can not be used inside another switch statement
+///
+///             static int Blink(Player *p)
+///             {
+///                 CR_BEGIN(&p->line);
+///                 CR_WAIT_UNTIL(&p->line, SlotFree());
+///                 CR_DELAY(&p->line, &p->timer, 100);
+///                 CR_END(&p->line);
+///             }
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef COROUTINE_H_
+#define COROUTINE_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+
+#include "Timer.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+
+// Coroutine results
+#define CR_WAITING		0		// Call again when something has changed
+#define CR_DONE			1		// Finished, the state is ready for a restart
+
+#define CR_BEGIN(line)	switch (*(line)) { case 0:
+
+#define CR_END(line)	} *(line) = 0; return CR_DONE
+
+// Give other work a turn, carry on from here next time
+#define CR_YIELD(line)							\
+	do											\
+	{											\
+		*(line) = __LINE__;						\
+		return CR_WAITING;						\
+		case __LINE__:;							\
+	} while (0)
+
+// Wait here until cond is true, it is checked each time the coroutine runs
+#define CR_WAIT_UNTIL(line, cond)				\
+	do											\
+	{											\
+		*(line) = __LINE__;						\
+		case __LINE__:							\
+		if (!(cond))							\
+		{										\
+			return CR_WAITING;					\
+		}										\
+	} while (0)
+
+// Wait ms, the timer's callback should arrange for the coroutine to be run
+#define CR_DELAY(line, timer, ms)				\
+	do											\
+	{											\
+		Timer_Start((timer), (ms));				\
+		CR_WAIT_UNTIL(line, !Timer_IsActive(timer));	\
+	} while (0)
+
+// Stop the coroutine, it starts from the beginning next time
+#define CR_EXIT(line)							\
+	do											\
+	{											\
+		*(line) = 0;							\
+		return CR_DONE;							\
+	} while (0)
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Where the coroutine is up to, 0 to start
+typedef uint16_t CoLine;
+
+#endif // COROUTINE_H_
@@ -0,0 +1,28 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Crc16.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for CRC16 (CCITT) calculation
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef CRC16_H_
+#define CRC16_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define CRC16_INIT		0xFFFF
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+uint16_t Crc16_Update(uint16_t crc, const uint8_t *data, uint32_t length);
+
+#endif // CRC16_H_
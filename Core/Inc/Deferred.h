@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Deferred.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for deferred work run from PendSV
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef DEFERRED_H_
+#define DEFERRED_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct Deferred Deferred;
+
+typedef void (*DeferredFunc)(void *arg);
+
+// One per piece of work, usually static. Queuing a job that is already
+// waiting does nothing, so the queue can never overflow.
+struct Deferred
+{
+	Deferred		*next;
+	DeferredFunc	func;
+	void			*arg;
+	volatile bool	pending;
+};
+
+typedef struct
+{
+	uint32_t	queued;			// Deferred_Queue() calls that added the job
+	uint32_t	merged;			// Calls for a job that was already waiting
+	uint32_t	runs;			// Jobs run
+	uint32_t	maxCycles;		// Longest single PendSV
+} DeferredStats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void Deferred_Init(Deferred *job, DeferredFunc func, void *arg);
+void Deferred_Queue(Deferred *job);
+void Deferred_Run(void);
+const DeferredStats_t *Deferred_GetStats(void);
+
+#endif // DEFERRED_H_
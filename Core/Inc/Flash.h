@@ -0,0 +1,36 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Flash.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the RAM resident flash erase driver
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef FLASH_H_
+#define FLASH_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	uint32_t	erases;
+	uint32_t	lastMs;			// Duration of the last erase
+	uint32_t	maxMs;
+} FlashStats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void Flash_Init(void);
+bool Flash_EraseSector(uint32_t sector);
+const FlashStats_t *Flash_GetStats(void);
+
+#endif // FLASH_H_
@@ -0,0 +1,33 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Format.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the lightweight printf style formatter
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef FORMAT_H_
+#define FORMAT_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Called once per output character, return false to stop formatting
+typedef bool (*FormatSink)(void *context, char c);
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+uint32_t Format_VPrint(FormatSink sink, void *context, const char *format, va_list args);
+uint32_t Format_Print(FormatSink sink, void *context, const char *format, ...);
+
+#endif // FORMAT_H_
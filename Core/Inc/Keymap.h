@@ -0,0 +1,121 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Keymap.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for key bindings and profiles
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef KEYMAP_H_
+#define KEYMAP_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb_hid_keyboard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+
+// Inputs that can be bound, the keys then the two encoder directions
+#define KEYMAP_ENCODER_UP		NUM_KEYS
+#define KEYMAP_ENCODER_DOWN		(NUM_KEYS + 1)
+#define KEYMAP_INPUTS			(NUM_KEYS + 2)
+
+#define KEYMAP_PROFILES			8		// Profile 0 is built in, the rest are uploaded
+#define KEYMAP_LAYERS			4		// Layer 0 is the base, always active
+#define KEYMAP_MACROS			32		// Macro slots, STORE_KEY_KEYMACRO()
+#define KEYMAP_COMBOS			26		// Every set of 2 or more keys, up to 32
+
+// Actions, a type in the top 4 bits and an argument in the rest
+#define ACTION_NONE				0x0000				// Not bound, the layer below shows through
+#define ACTION_MACRO(n)			(0x1000 | (n))		// Play macro slot n
+#define ACTION_LIBRARY(id)		(0x2000 | (id))		// Play library macro id
+#define ACTION_LAYER_MO(l)		(0x3000 | (l))		// Layer l while held
+#define ACTION_LAYER_TG(l)		(0x4000 | (l))		// Layer l on / off
+#define ACTION_LAYER_OS(l)		(0x5000 | (l))		// Layer l for the next key only
+#define ACTION_TAP_LAYER(l, n)	(0x6000 | ((l) << 8) | (n))	// Tap plays macro slot n, hold is layer l
+#define ACTION_TAP_MOD(b, n)	(0x7000 | ((b) << 8) | (n))	// Tap plays macro slot n, hold is modifier bit b
+#define ACTION_LEADER			0x8000				// Start a leader sequence
+#define ACTION_PANIC			0x9000				// Stop all macros and let go of every key
+#define ACTION_TURBO(u)			(0xA000 | (u))		// Tap HID usage u over and over while held
+#define ACTION_BLOCK			0xF000				// Does nothing, hides the layers below
+
+#define ACTION_TYPE(a)			((a) & 0xF000)
+#define ACTION_ARG(a)			((a) & 0x0FFF)
+#define ACTION_HOLD(a)			(((a) >> 8) & 0x0F)	// Layer or modifier bit of a tap hold key
+#define ACTION_TAP(a)			((a) & 0xFF)		// Macro slot of a tap hold key
+
+// Tap hold keys. A hold is decided by the tapping term, or sooner in these modes
+#define KEYMAP_TAPPING_TERM		200		// ms, default
+#define KEYMAP_MIN_TAPPING_TERM	50
+#define KEYMAP_MAX_TAPPING_TERM	1000
+#define KEYMAP_PERMISSIVE_HOLD	0x01	// Another key tapped while it is down
+#define KEYMAP_HOLD_ON_OTHER	0x02	// Another key pressed while it is down
+
+// Combos, keys pressed together within the combo term
+#define KEYMAP_COMBO_TERM		50		// ms, default
+#define KEYMAP_MIN_COMBO_TERM	10
+#define KEYMAP_MAX_COMBO_TERM	500
+
+// Leader sequences, each key must follow the last within the timeout
+#define KEYMAP_LEADER_TIMEOUT	1000	// ms, default
+#define KEYMAP_MIN_LEADER_TIMEOUT	100
+#define KEYMAP_MAX_LEADER_TIMEOUT	5000
+
+// A leader trie is an array of nodes, node 0 the root :
+//
+//     action(2) child(2) x KEYMAP_INPUTS
+//
+// child n is the node index that input n leads to, 0 for none. A node with
+// no children ends the sequence at once, otherwise its action, if any, is
+// done when the timeout runs out.
+#define KEYMAP_NODE_BYTES		(2 + (2 * KEYMAP_INPUTS))
+
+// One layer of a built in keymap, in input order so it reads like the pad
+#define KEYMAP_LAYOUT(k1, k2, k3, k4, kr, up, down)		{k1, k2, k3, k4, kr, up, down}
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef uint16_t Action;
+
+typedef struct
+{
+	uint8_t		keys;			// Bit n for key n
+	Action		action;
+} Combo;
+
+typedef struct
+{
+	uint8_t		number;
+	Action		actions[KEYMAP_LAYERS][KEYMAP_INPUTS];
+	uint8_t		numCombos;
+	Combo		combos[KEYMAP_COMBOS];
+	uint32_t	containing[NUM_KEYS];	// Bit n set if combos[n] has the key
+} Profile;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void     Keymap_Init(void);
+bool     Keymap_Load(uint8_t number);
+uint8_t  Keymap_GetProfile(void);
+bool     Keymap_SetLayer(uint8_t number, uint8_t layer, const uint8_t *actions, uint16_t length);
+void     Keymap_Event(uint8_t input, bool pressed);
+void     Keymap_Cancel(void);
+bool     Keymap_SetCombo(uint8_t number, uint8_t keys, Action action);
+bool     Keymap_SetTapping(uint32_t term, uint8_t mode);
+void     Keymap_GetTapping(uint32_t *term, uint8_t *mode);
+bool     Keymap_SetComboTerm(uint32_t term);
+uint32_t Keymap_GetComboTerm(void);
+bool     Keymap_SetLeaderTimeout(uint32_t timeout);
+uint32_t Keymap_GetLeaderTimeout(void);
+int      Keymap_Command(int argc, char *argv[]);
+
+#endif // KEYMAP_H_
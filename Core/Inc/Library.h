@@ -0,0 +1,59 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Library.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the named macro library
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBRARY_H_
+#define LIBRARY_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Store.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define LIBRARY_SIZE		1024			// Macro IDs 0 to LIBRARY_SIZE - 1
+#define LIBRARY_NAME_MAX	31
+#define LIBRARY_NONE		(-1)
+#define LIBRARY_PAGE		16				// Macros listed per page
+
+#define MACRO_UPLOAD_SIZE	STORE_MAX_VALUE	// Largest macro that can be uploaded
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// A library macro, pointers into the flash store
+typedef struct
+{
+	const char		*name;			// Not terminated
+	uint8_t			nameLength;
+	const uint8_t	*code;
+	uint16_t		length;
+} LibraryEntry;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void    Library_Init(void);
+int32_t Library_Find(const char *name);
+bool    Library_Get(uint16_t id, LibraryEntry *entry);
+bool    Library_Put(uint16_t id, const uint8_t *value, uint16_t length);
+bool    Library_Delete(uint16_t id);
+bool    Library_Play(uint16_t id);
+bool    Library_Upload(uint16_t storeKey, uint16_t offset, const uint8_t *data, uint16_t length);
+
+int     Library_MacroCommand(int argc, char *argv[]);
+int     Library_ListCommand(int argc, char *argv[]);
+int     Library_PlayCommand(int argc, char *argv[]);
+
+#endif // LIBRARY_H_
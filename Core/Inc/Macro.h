@@ -0,0 +1,100 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Macro.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for macro playback
+///
+///             A macro is a string of byte code instructions. Printable
+///             characters (0x20 to 0x7E), tab and newline type themselves
+///             and carriage return is skipped, so plain text followed by
+///             OP_END is already a macro. The rest :
+///
+///                 OP_END                      Finish, releasing all keys
+///                 OP_PRESS    usage           Hold a key down
+///                 OP_RELEASE  usage           Let it go
+///                 OP_TAP      usage           Press and release
+///                 OP_MOD_DOWN bits            Hold modifiers (MOD_xxx)
+///                 OP_MOD_UP   bits            Let them go
+///                 OP_TYPE     length chars    Type any characters, '\n' etc
+///                 OP_DELAY    ms              Wait, ms is a varint
+///                 OP_REPEAT   count           Run up to OP_NEXT count times,
+///                                             1 to 255
+///                 OP_NEXT
+///                 OP_JUMP     offset          Signed 16 bit LE, from the
+///                                             next instruction
+///                 OP_PACKED   length data     Type LZSS compressed text,
+///                                             length is a varint
+///
+///             Varints are 7 bits per byte, least significant first, with
+///             bit 7 set on all but the last byte.
+///
+///             OP_PACKED data is groups of up to 8 items, each group led by
+///             a flags byte, least significant bit first. A set bit is a
+///             literal character, a clear bit is a copy of earlier text :
+///
+///                 distance-1(1) length-3(1)
+///
+///             reaching back up to MACRO_WINDOW characters into what the
+///             same OP_PACKED has typed. The copy may overlap what it makes,
+///             so runs cost one copy. Reaching back before the first
+///             character is a bad instruction. host/MacroPack.cpp encodes it.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef MACRO_H_
+#define MACRO_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define MACRO_MAX_PLAYERS	4		// Macros that can play at the same time
+#define MACRO_NO_KEY		(-1)	// Start playing straight away
+#define MACRO_MAX_LOOPS		2		// OP_REPEAT nesting
+#define MACRO_WINDOW		256		// OP_PACKED history per player, fixed by the format
+
+// Instructions
+#define OP_END				0x00
+#define OP_PRESS			0x01
+#define OP_RELEASE			0x02
+#define OP_TAP				0x03
+#define OP_MOD_DOWN			0x04
+#define OP_MOD_UP			0x05
+#define OP_TYPE				0x06
+#define OP_DELAY			0x07
+#define OP_REPEAT			0x08
+#define OP_PACKED			0x0B
+#define OP_NEXT				0x0C
+#define OP_JUMP				0x0E	// 0x09, 0x0A and 0x0D are text
+
+// Modifier bits
+#define MOD_LEFT_CTRL		0x01
+#define MOD_LEFT_SHIFT		0x02
+#define MOD_LEFT_ALT		0x04
+#define MOD_LEFT_GUI		0x08
+#define MOD_RIGHT_CTRL		0x10
+#define MOD_RIGHT_SHIFT		0x20
+#define MOD_RIGHT_ALT		0x40
+#define MOD_RIGHT_GUI		0x80
+
+// Helpers for writing macros as C initialisers
+#define M_DELAY(ms)			OP_DELAY, (uint8_t)(0x80 | ((ms) & 0x7F)), (uint8_t)(((ms) >> 7) & 0x7F)
+#define M_JUMP(offset)		OP_JUMP, (uint8_t)((offset) & 0xFF), (uint8_t)(((offset) >> 8) & 0xFF)
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void    Macro_Init(void);
+bool    Macro_Play(const uint8_t *code, uint16_t length, int8_t key);
+void    Macro_Cancel(uint8_t player);
+uint8_t Macro_Abort(void);
+void    Macro_Update(void);
+int     Macro_Command(int argc, char *argv[]);
+
+#endif // MACRO_H_
@@ -0,0 +1,80 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Protocol.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the binary host protocol
+///
+///             Frames share USART2 with the text CLI. Each frame is sent as
+///             0x00, COBS encoded body, 0x00. The body is :
+///
+///                 type | seq | ack | payload (0-64) | CRC16 (LSB first)
+///
+///             seq numbers each reliable frame, ack is the next seq the
+///             sender expects. Up to PROTOCOL_WINDOW frames may be unacked,
+///             anything unacked after PROTOCOL_RETRY_MS is sent again.
+///             All multi-byte payload fields are little endian.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define PROTOCOL_MAX_PAYLOAD	64
+#define PROTOCOL_WINDOW			4
+#define PROTOCOL_RETRY_MS		200
+
+// Frame types, ACK and NAK are not sequenced
+#define MSG_ACK					0x01	// No payload
+#define MSG_NAK					0x02	// No payload, resend from ack
+#define MSG_PING				0x10	// Any payload, echoed in MSG_PONG
+#define MSG_PONG				0x11
+#define MSG_CONFIG_READ			0x20	// key(1)
+#define MSG_CONFIG_VALUE		0x21	// key(1) value(4), reply to read/write
+#define MSG_CONFIG_WRITE		0x22	// key(1) value(4)
+#define MSG_MACRO_WRITE			0x30	// slot(1) offset(2) byte code, offset 0 replaces
+#define MSG_LIBRARY_WRITE		0x31	// id(2) offset(2) nameLength(1) name byte code
+#define MSG_LIBRARY_PLAY		0x32	// name
+#define MSG_LIBRARY_DELETE		0x33	// id(2)
+#define MSG_PROFILE_WRITE		0x34	// profile(1) layer(1) action(2) x KEYMAP_INPUTS
+#define MSG_COMBO_WRITE			0x35	// profile(1) keys(1) action(2), ACTION_NONE removes
+#define MSG_LEADER_WRITE		0x36	// profile(1) offset(2) trie, offset 0 replaces
+#define MSG_TELEMETRY			0x40	// See Protocol.c SendTelemetry()
+#define MSG_ERROR				0x7F	// type(1) reason(1)
+
+// MSG_ERROR reasons
+#define PROTOCOL_ERR_TYPE		1		// Unknown frame type
+#define PROTOCOL_ERR_LENGTH		2		// Payload the wrong size
+#define PROTOCOL_ERR_KEY		3		// Unknown config key / macro key / macro name
+#define PROTOCOL_ERR_VALUE		4		// Value out of range
+
+// Config keys
+#define CONFIG_OUTPUT_POLICY	0		// OutputPolicy
+#define CONFIG_TELEMETRY_MS		1		// Telemetry period, 0 = off
+#define CONFIG_SCREEN_FPS		2		// SCREEN_MIN_FPS to SCREEN_MAX_FPS
+#define CONFIG_PROFILE			3		// Keymap profile in use
+#define CONFIG_TAPPING_TERM		4		// ms, KEYMAP_MIN_TAPPING_TERM to KEYMAP_MAX_TAPPING_TERM
+#define CONFIG_TAP_MODE			5		// KEYMAP_PERMISSIVE_HOLD | KEYMAP_HOLD_ON_OTHER
+#define CONFIG_COMBO_TERM		6		// ms, KEYMAP_MIN_COMBO_TERM to KEYMAP_MAX_COMBO_TERM
+#define CONFIG_LEADER_TIMEOUT	7		// ms, KEYMAP_MIN_LEADER_TIMEOUT to KEYMAP_MAX_LEADER_TIMEOUT
+#define CONFIG_PANIC_KEYS		8		// Bit n for key n, 0 for no panic chord
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+bool Protocol_ProcessByte(uint8_t data);
+void Protocol_Update(void);
+void Protocol_LoadConfig(void);
+bool Protocol_Send(uint8_t type, const uint8_t *payload, uint8_t length);
+int  Protocol_Command(int argc, char *argv[]);
+
+#endif // PROTOCOL_H_
@@ -0,0 +1,41 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Scheduler.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the cooperative task scheduler
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+
+// Event flags, raised from interrupts with Scheduler_Signal()
+#define EVENT_UART_RX		(1UL << 0)		// Byte added to rxBuffer
+#define EVENT_UART_TX		(1UL << 1)		// UART finished a block, txBuffer has room
+#define EVENT_USB			(1UL << 2)		// USB interrupt serviced
+#define EVENT_TICK			(1UL << 3)		// SysTick, every ms
+#define EVENT_ENCODER		(1UL << 4)		// TIM3 rotary encoder moved
+#define EVENT_EXTI			(1UL << 5)		// External interrupt line
+#define EVENT_MACRO			(1UL << 6)		// A macro player may be able to continue
+#define EVENT_HID			(1UL << 7)		// A report went to the host, the queue has room
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void Scheduler_Init(void);
+void Scheduler_Run(void);
+void Scheduler_Yield(void);
+void Scheduler_Signal(uint32_t events);
+int  Scheduler_Command(int argc, char *argv[]);
+
+#endif // SCHEDULER_H_
@@ -0,0 +1,46 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Store.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the flash key/value store
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef STORE_H_
+#define STORE_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define STORE_MAX_KEYS		1200		// Live keys the RAM index can hold
+#define STORE_MAX_VALUE		4096		// Largest value in bytes
+
+// Key ranges
+#define STORE_KEY_CONFIG(n)		(0x0000 + (n))		// Protocol CONFIG_xxx, 4 bytes
+#define STORE_KEY_KEYMACRO(n)	(0x0100 + (n))		// Macro slot, see Keymap.c
+#define STORE_KEY_PROFILE(n)	(0x0200 + (n))		// Keymap profile, see Keymap.c
+#define STORE_KEY_COMBOS(n)		(0x0300 + (n))		// Keymap profile's combos
+#define STORE_KEY_LEADER(n)		(0x0400 + (n))		// Keymap profile's leader trie
+#define STORE_KEY_TURBO(n)		(0x0500 + (n))		// Key repeat rate, see Turbo.c
+#define STORE_KEY_LIBRARY(n)	(0x1000 + (n))		// Named macro, see Library.c
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void           Store_Init(void);
+const uint8_t *Store_Get(uint16_t key, uint16_t *length);
+bool           Store_Put(uint16_t key, const void *data, uint16_t length);
+bool           Store_Delete(uint16_t key);
+void           Store_Pin(const void *data);
+void           Store_Unpin(const void *data);
+void           Store_Update(void);
+int            Store_Command(int argc, char *argv[]);
+
+#endif // STORE_H_
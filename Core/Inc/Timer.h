@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Timer.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the software timer wheel
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+
+// Longest delay, about 17 minutes. Longer delays are cut to this.
+#define TIMER_MAX_DELAY		((1UL << 20) - 1)
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct Timer Timer;
+
+typedef void (*TimerCallback)(Timer *timer);
+
+// Owned by the caller, usually static. Do not touch the fields directly.
+struct Timer
+{
+	Timer			*next;
+	Timer			**pprev;		// Link pointing at this timer, NULL when stopped
+	uint32_t		expires;		// Tick the timer fires on
+	TimerCallback	callback;
+	void			*context;		// For the callback's use
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void Timer_Init(Timer *timer, TimerCallback callback, void *context);
+void Timer_Start(Timer *timer, uint32_t delay);
+void Timer_Stop(Timer *timer);
+bool Timer_IsActive(const Timer *timer);
+void Timer_Process(void);
+
+#endif // TIMER_H_
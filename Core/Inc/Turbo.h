@@ -0,0 +1,51 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Turbo.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for turbo and typematic key repeat
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TURBO_H_
+#define TURBO_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define TURBO_MIN_HZ		1
+#define TURBO_MAX_HZ		500		// A press and a release, one USB frame each
+#define TURBO_MAX_DELAY		2000	// ms before repeating starts, 0 for turbo
+
+#define TURBO_HZ			20		// Defaults
+#define TURBO_DELAY			0
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	uint32_t	taps;
+	uint32_t	missed;			// Report queue full when due
+	uint32_t	lateSum;		// Frames after due, over all taps
+	uint32_t	lateMax;
+} TurboStats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+void Turbo_Init(void);
+void Turbo_Start(uint8_t key, uint8_t usage);
+void Turbo_Stop(uint8_t key);
+void Turbo_StopAll(void);
+bool Turbo_SetRate(uint8_t key, uint16_t hz, uint16_t delay);
+const TurboStats_t *Turbo_GetStats(void);
+int  Turbo_Command(int argc, char *argv[]);
+
+#endif // TURBO_H_
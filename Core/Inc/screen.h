@@ -10,17 +10,32 @@
 ///////////////////////////////////////////////////////////////////////////////
 // Includes
 ///////////////////////////////////////////////////////////////////////////////
+#include <stdarg.h>
 #include "stdint.h"
 
 #ifndef SCREEN_H_
 #define SCREEN_H_
 
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define SCREEN_MIN_FPS	1
+#define SCREEN_MAX_FPS	50
+
 ///////////////////////////////////////////////////////////////////////////////
 // Public Function declarations
 ///////////////////////////////////////////////////////////////////////////////
 void ScreenUpdate(void);
+void ScreenTick(void);
+void ScreenSetFrameRate(uint32_t fps);
+uint32_t ScreenGetFrameRate(void);
+int  ScreenFpsCommand(int argc, char *argv[]);
 void ScreenInit(void);
 void ClearScreen(void);
 void RefreshScreen(void);
+uint32_t ScreenVPrintAt(int row, int col, const char *format, va_list args);
+uint32_t ScreenPrintAt(int row, int col, const char *format, ...);
+void ScreenSetCursor(int row, int col);
+void ScreenFlush(void);
 
 #endif // SCREEN_H_
@@ -58,6 +58,7 @@ void SysTick_Handler(void);
 void USART2_IRQHandler(void);
 void OTG_FS_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void TIM3_IRQHandler(void);
 
 /* USER CODE END EFP */
 
@@ -3,9 +3,19 @@
 
 #include <stdint.h>
 #include "stm32f4xx_hal.h"
+#include "Macro.h"
 
 #define NUM_KEYS 5
 
+// Whatever holds keys down, each report is all of them merged
+#define HID_SOURCE_KEYMAP	0						// Dual role keys held as modifiers
+#define HID_SOURCE_TYPE		1						// CLI type-through
+#define HID_SOURCE_MACRO(n)	(2 + (n))				// Macro player n
+#define HID_SOURCE_TURBO(n)	(2 + MACRO_MAX_PLAYERS + (n))	// Key n repeating
+#define HID_SOURCES			(2 + MACRO_MAX_PLAYERS + NUM_KEYS)
+
+#define PANIC_KEYS			0x0F					// Default chord, KEY_1 to KEY_4
+
 #define TOGGLE_DIR_CLOCK	1
 #define TOGGLE_DIR_ANTI		2
 
@@ -18,14 +28,23 @@ typedef struct tagGPIOKEY
 } GPIOKEY;
 
 
+void    USB_Keyboard_Init();
 void    USB_Keyboard_Scan();
+void    USB_Keyboard_Sample(void);
 bool    USB_IsKeyPressed(int key);
 int     USB_GetKeycount(int key);
 int     USB_GetTogglecount();
 uint8_t USB_GetToggDirection();
-
-//void USB_Keyboard_SendChar(char ch);
-//void USB_Keyboard_SendString(char * s);
+bool    USB_SetKeyMacro(uint8_t key, uint16_t offset, const uint8_t *code, uint16_t length);
+bool    USB_SetPanicKeys(uint8_t keys);
+uint8_t USB_GetPanicKeys(void);
+
+uint32_t USB_Keyboard_QueueSpace(void);
+uint32_t USB_Keyboard_Frame(void);
+bool     USB_Keyboard_QueueReport(uint8_t source, uint8_t modifier, const uint8_t *keycodes, uint8_t count);
+bool     USB_Keyboard_AsciiToHid(char ch, uint8_t *modifier, uint8_t *keycode);
+void     USB_Keyboard_Interrupt(void);
+void     USB_Keyboard_Panic(void);
 
 #endif
 
@@ -13,11 +13,21 @@
 #include "CLI.h"
 #include "screen.h"
 #include <stdarg.h>
-#include <stdio.h>
 #include <string.h>
 
 #include "stm32f4xx_hal.h"
 #include "CircularBuffer.h"
+#include "Deferred.h"
+#include "Format.h"
+#include "Keymap.h"
+#include "Library.h"
+#include "Macro.h"
+#include "Protocol.h"
+#include "Scheduler.h"
+#include "Store.h"
+#include "Timer.h"
+#include "Turbo.h"
+#include "usb_hid_keyboard.h"
 #include "main.h"
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -30,35 +40,86 @@
 #define LF				'\n'
 #define DEL				127
 #define ESC				27				// Quit display mode
-#define NUM_CMDS	    3
+#define EOT				4				// Ctrl-D, ends type-through
+#define XON				0x11			// Ctrl-Q, host may send again
+#define XOFF			0x13			// Ctrl-S, host must stop sending
+#define NUM_CMDS	    (sizeof(cmds) / sizeof(cmds[0]))
+#define MAX_ARGS		8				// Including the command name
+#define MESSAGE_WIDTH	76				// Message line, inside the border
+#define MESSAGE_TIME	5000			// ms before a message is cleared
+
+#define TX_BLOCK_TIMEOUT	500			// ms to wait for txBuffer space before dropping
+#define TX_CHUNK			64			// Most bytes per UART transfer, about 5.6ms at 115200
+#define PRODUCER_SPACE		128			// Free bytes needed before running a producer step
+#define MAX_PRODUCERS		4
+
+// Type-through flow control, rxBuffer levels. The gap above FLOW_STOP covers
+// what is already on its way when the host sees XOFF, and what arrives while
+// a TX_CHUNK transfer holds the XOFF back.
+#define FLOW_STOP			((RX_BUFFER_SIZE * 3) / 4)
+#define FLOW_START			(RX_BUFFER_SIZE / 4)
 
 ///////////////////////////////////////////////////////////////////////////////
 // Type definitions
 ///////////////////////////////////////////////////////////////////////////////
-typedef void (*clifunc)();
-
 typedef struct tagCOMMAND
 {
-	char	text[20];
-	clifunc	func;
+	const char	*text;
+	clifunc		func;
+	uint8_t		minArgs;		// Not counting the command name
+	uint8_t		maxArgs;
+	const char	*usage;
+	const char	*help;
 } COMMAND;
 
+// Formatted output written straight into the free space of txBuffer
+typedef struct
+{
+	uint32_t	free;		// Space reserved since the last commit
+	uint32_t	count;		// Bytes written since the last commit
+	bool		dropping;	// Out of space, discard the rest of this write
+} TxWriter;
+
+// Long output waiting to be generated a step at a time
+typedef struct
+{
+	OutputProducer	producer;
+	uint32_t		step;
+} ProducerSlot;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Private Function declarations
 ///////////////////////////////////////////////////////////////////////////////
 
 // CLI Functions
-static void Help(void);
-static void Test1(void);
-static void Test2(void);
-static void Test3(void);
+static int  Help(int argc, char *argv[]);
+static int  SetOutput(int argc, char *argv[]);
+static int  Test1(int argc, char *argv[]);
+static int  Test2(int argc, char *argv[]);
+static int  Test3(int argc, char *argv[]);
+static int  TxStats(int argc, char *argv[]);
+static int  TypeThrough(int argc, char *argv[]);
+static bool HelpProducer(uint32_t step);
+static void MessageExpired(Timer *timer);
+
+static const COMMAND *FindCommand(const char *text);
+static int            Tokenise(char *line, char *argv[]);
+static void           Execute(char *line);
 
 uint32_t RxBytesAvailable();
-void     SendData(const char *data, uint32_t length);
-uint32_t StartTransmit(void);
+static void StartTransmit(void *arg);
+static uint8_t FlowControl(void);
+static void TypeText(void);
+static void StopTyping(void);
 bool     ReadByte(uint8_t *data);
 void     EraseOldUser();
 
+static void     TxBegin(TxWriter *writer);
+static bool     TxSink(void *context, char c);
+static void     TxEnd(TxWriter *writer);
+static bool     WaitForSpace(void);
+static uint32_t VOutputAt(int x, int y, const char *format, va_list args);
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Variable Definitions
@@ -71,18 +132,56 @@ uint8_t	cliIndex = 0;
 uint8_t Rx_data;
 bool    gotData = false;
 
-static bool isTransmitting = false;
+static bool     isTransmitting = false;
+static uint32_t txLength = 0;			// Bytes handed to the UART, still in txBuffer
+
+static OutputPolicy	outputPolicy = OUTPUT_POLICY_ASYNC;
+static TxStats_t	txStats = {0};
+
+static ProducerSlot	producers[MAX_PRODUCERS];
+static uint8_t		producerHead = 0;
+static uint8_t		producerCount = 0;
+
+static Timer		messageTimer;
+static Deferred		txJob;					// Runs StartTransmit()
+
+// Type-through, received text is typed into the host instead of the CLI
+static volatile bool	typing = false;
+static bool				typeStarting = false;	// The LF of a CR LF may follow the command
+static bool				flowStopped = false;	// XOFF sent, only touched by StartTransmit()
+static uint8_t			flowChar;				// Being sent by the UART
+static uint8_t			heldModifier = 0;		// Key type-through has down
+static uint8_t			heldUsage = 0;
+static TypeStats_t		typeStats = {0};
 
 CircularBuffer_t txBuffer;
 CircularBuffer_t rxBuffer;
 uint8_t          UserRxBufferFS[RX_BUFFER_SIZE];
 uint8_t          UserTxBufferFS[TX_BUFFER_SIZE];
 
-COMMAND cmds[NUM_CMDS] =
+static const char *policyNames[] = {"drop", "block", "async"};
+
+// Looked up with a binary search, so keep in strcmp() order
+static const COMMAND cmds[] =
 {
-	{"test1", Test1},
-	{"test2", Test2},
-	{"test3", Test3},
+	{"?",       Help,      0, 1, "[command]",          "Same as help"},
+	{"fps",     ScreenFpsCommand, 0, 1, "[1-50]",      "Show or set the screen update rate"},
+	{"help",    Help,      0, 1, "[command]",          "List commands, or describe one"},
+	{"macro",   Library_MacroCommand, 1, 3, "<id> [name text]", "Define a library macro, or delete it"},
+	{"macros",  Library_ListCommand, 0, 1, "[page]",   "List library macros by name"},
+	{"output",  SetOutput, 0, 1, "[drop|block|async]", "Show or set the TX overflow policy"},
+	{"play",    Library_PlayCommand, 1, 1, "<name|id>", "Play a library macro"},
+	{"players", Macro_Command, 0, 1, "[n|all]",         "Show macro players, or stop one or all"},
+	{"profile", Keymap_Command, 0, 1, "[0-7]",         "Show the key bindings, or switch profile"},
+	{"proto",   Protocol_Command, 0, 0, "",            "Show binary protocol statistics"},
+	{"store",   Store_Command, 0, 1, "[gc]",           "Show flash store use, or compact it"},
+	{"tasks",   Scheduler_Command, 0, 1, "[reset]",    "Show task run counts and CPU use"},
+	{"test1",   Test1,     0, 0, "",                   "Test command one"},
+	{"test2",   Test2,     0, 0, "",                   "Test command two"},
+	{"test3",   Test3,     0, 0, "",                   "Test command three"},
+	{"turbo",   Turbo_Command, 0, 3, "[key hz [delay]]", "Show repeat rates and timing, or set a key's"},
+	{"txstats", TxStats,   0, 0, "",                   "Show TX buffer statistics"},
+	{"type",    TypeThrough, 0, 0, "",                 "Type received text into the host, Ctrl-D ends"},
 };
 
 extern UART_HandleTypeDef huart2;
@@ -92,70 +191,254 @@ extern UART_HandleTypeDef huart2;
 ///////////////////////////////////////////////////////////////////////////////
 void Prompt(void)
 {
-	OutputAt(22, 3, ">");
+	ScreenPrintAt(22, 3, ">");
 }
 
-void Message(const char *text)
+void Message(const char *format, ...)
 {
-	char szBuffer[] = "                                                                            ";
-	int  len;
+	va_list		args;
+	uint32_t	length;
+
+	va_start(args, format);
+	length = ScreenVPrintAt(23, 3, format, args);
+	va_end(args);
 
-	// Merge text
-	len = strlen(text);
-	memcpy(szBuffer, text, len);
+	// Blank out the rest of any older, longer message
+	if (length < MESSAGE_WIDTH)
+	{
+		ScreenPrintAt(23, 3 + length, "%*s", (int)(MESSAGE_WIDTH - length), "");
+	}
 
-	OutputAt(23, 3, szBuffer);
+	Timer_Start(&messageTimer, MESSAGE_TIME);
 }
 
 void CLI_Init(void)
 {
 	HAL_UART_Receive_IT(&huart2, &Rx_data, 1);
 
-	CircularBuffer_Init(&txBuffer, UserRxBufferFS, RX_BUFFER_SIZE);
-	CircularBuffer_Init(&rxBuffer, UserTxBufferFS, TX_BUFFER_SIZE);
+	CircularBuffer_Init(&txBuffer, UserTxBufferFS, TX_BUFFER_SIZE);
+	CircularBuffer_Init(&rxBuffer, UserRxBufferFS, RX_BUFFER_SIZE);
+
+	Timer_Init(&messageTimer, MessageExpired, NULL);
+	Deferred_Init(&txJob, StartTransmit, NULL);
+
+	// The lookup relies on the table being sorted
+	for (uint32_t i = 1; i < NUM_CMDS; i++)
+	{
+		if (strcmp(cmds[i - 1].text, cmds[i].text) >= 0)
+		{
+			Message("cmds[] out of order at \"%s\"", cmds[i].text);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Parse a signed integer argument, decimal or 0x prefixed hex
+///
+/// @param   text  - Argument to parse
+/// @param   min   - Smallest allowed value
+/// @param   max   - Largest allowed value
+/// @param   value - Receives the value
+///
+/// @return  true if the whole argument is a number within range
+///////////////////////////////////////////////////////////////////////////////
+bool CLI_ParseInt(const char *text, int32_t min, int32_t max, int32_t *value)
+{
+	bool     negative = false;
+	uint32_t base     = 10;
+	uint32_t result   = 0;
+	bool     ret      = false;
+
+	if ('-' == *text)
+	{
+		negative = true;
+		text++;
+	}
+
+	if ('0' == text[0] && ('x' == text[1] || 'X' == text[1]))
+	{
+		base  = 16;
+		text += 2;
+	}
+
+	while (*text)
+	{
+		uint32_t digit;
+
+		if (*text >= '0' && *text <= '9')
+		{
+			digit = *text - '0';
+		}
+		else if (16 == base && *text >= 'a' && *text <= 'f')
+		{
+			digit = *text - 'a' + 10;
+		}
+		else if (16 == base && *text >= 'A' && *text <= 'F')
+		{
+			digit = *text - 'A' + 10;
+		}
+		else
+		{
+			return false;
+		}
+
+		// Anything this big is out of range anyway
+		if (result > 0x7FFFFFF)
+		{
+			return false;
+		}
+
+		result = (result * base) + digit;
+		ret    = true;
+		text++;
+	}
+
+	if (ret)
+	{
+		int32_t signedResult = negative ? -(int32_t)result : (int32_t)result;
+
+		ret = (signedResult >= min) && (signedResult <= max);
+		if (ret)
+		{
+			*value = signedResult;
+		}
+	}
+
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Parse an on/off style argument
+///
+/// @return  true if the argument was recognised
+///////////////////////////////////////////////////////////////////////////////
+bool CLI_ParseBool(const char *text, bool *value)
+{
+	static const char *choices[] = {"off", "on", "0", "1", "no", "yes", "false", "true"};
+	int                index     = CLI_ParseChoice(text, choices, sizeof(choices) / sizeof(choices[0]));
+
+	if (index >= 0)
+	{
+		*value = (index & 1);
+	}
+
+	return (index >= 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Match an argument against a list of keywords
+///
+/// @return  Index of the matching keyword, or -1
+///////////////////////////////////////////////////////////////////////////////
+int CLI_ParseChoice(const char *text, const char * const choices[], int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (0 == strcmp(text, choices[i]))
+		{
+			return i;
+		}
+	}
+
+	return -1;
 }
 
 void Output(const char *format, ...)
 {
 	va_list		args;
-	char		szBuffer[100] = {0};
-	uint32_t	length = 0;
+	TxWriter	writer;
 
+	TxBegin(&writer);
 	va_start(args, format);
-	length = sprintf(szBuffer, format, args);
+	Format_VPrint(TxSink, &writer, format, args);
 	va_end(args);
-
-	SendData(szBuffer, length);
+	TxEnd(&writer);
 }
 
 void OutputAt(int x, int y, const char *format, ...)
 {
 	va_list		args;
-	char		szBuffer[200] = {0};
-	char		szText[200] = {0};
-	uint32_t	length;
 
-	// [ *l ; *c H	Move cursor to line *l, column *c
-	// [ *l ; *c f	Move curosr to line *l, column *c
-	sprintf(szBuffer, "\033[%d;%dH", x, y);
 	va_start(args, format);
-	vsprintf(szText, format, args);
+	VOutputAt(x, y, format, args);
 	va_end(args);
+}
 
-	strcat(szBuffer, szText);
-	length = strlen(szBuffer);
+// Raw bytes as one write, returns false if the output policy dropped them
+bool SendData(const char *data, uint32_t length)
+{
+	TxWriter writer;
+
+	TxBegin(&writer);
+	for (uint32_t i = 0; i < length; i++)
+	{
+		TxSink(&writer, data[i]);
+	}
+	TxEnd(&writer);
 
-	SendData(szBuffer, length);
+	return !writer.dropping;
 }
 
-void SendData(const char *data, uint32_t length)
+void CLI_SetOutputPolicy(OutputPolicy policy)
 {
-	for (uint32_t i = 0; i < length; i++)
+	outputPolicy = policy;
+}
+
+OutputPolicy CLI_GetOutputPolicy(void)
+{
+	return outputPolicy;
+}
+
+const TxStats_t *CLI_GetTxStats(void)
+{
+	return &txStats;
+}
+
+const TypeStats_t *CLI_GetTypeStats(void)
+{
+	return &typeStats;
+}
+
+// Queue a long output. With OUTPUT_POLICY_ASYNC it is generated from
+// CLI_Update() whenever txBuffer has room for another step, otherwise it is
+// run to completion now and the policy applies to each step. Returns false
+// if MAX_PRODUCERS are already queued, the caller must say so.
+bool CLI_StartProducer(OutputProducer producer)
+{
+	bool ret = false;
+
+	if (OUTPUT_POLICY_ASYNC != outputPolicy)
 	{
-		CircularBuffer_WriteByte(&txBuffer, data[i]);
+		for (uint32_t step = 0; !producer(step); step++)
+		{
+		}
+		ret = true;
 	}
+	else if (producerCount < MAX_PRODUCERS)
+	{
+		ProducerSlot *slot = &producers[(producerHead + producerCount) % MAX_PRODUCERS];
+
+		slot->producer = producer;
+		slot->step     = 0;
+		producerCount++;
+		ret = true;
 
-	StartTransmit();
+		// Queued from outside the cli task, nothing else may wake it
+		Scheduler_Signal(EVENT_UART_TX);
+	}
+
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   End type-through, if it is running
+///////////////////////////////////////////////////////////////////////////////
+void CLI_StopTyping(void)
+{
+	if (typing)
+	{
+		StopTyping();
+	}
 }
 
 // Called by Main()
@@ -163,17 +446,38 @@ void CLI_Update(void)
 {
 	uint8_t data;
 
-	while (RxBytesAvailable() > 0)
+	if (typing)
+	{
+		TypeText();
+	}
+
+	while (!typing && (RxBytesAvailable() > 0))
 	{
 		ReadByte(&data);
-		CLI_ProcessNewData(data);
+
+		// Binary frames are multiplexed with the text
+		if (!Protocol_ProcessByte(data))
+		{
+			CLI_ProcessNewData(data);
+		}
+	}
+
+	// Continue long output as the UART makes room for it
+	while ((producerCount > 0) &&
+	       (CircularBuffer_FreeItems(&txBuffer) >= PRODUCER_SPACE))
+	{
+		ProducerSlot *slot = &producers[producerHead];
+
+		if (slot->producer(slot->step++))
+		{
+			producerHead = (producerHead + 1) % MAX_PRODUCERS;
+			producerCount--;
+		}
 	}
 }
 
 void CLI_ProcessNewData(uint8_t data)
 {
-	char szBuffer[200] = {0};
-
 	// Save the new character
 	cliBuffer[cliIndex] = data;
 
@@ -183,45 +487,21 @@ void CLI_ProcessNewData(uint8_t data)
 	{
 		cliBuffer[cliIndex] = 0;
 
-		// Which command ?
-		if ((0 == strcmp("help", cliBuffer)) ||
-		    (0 == strcmp("?", cliBuffer)))
-		{
-			Help();
-		}
-		else
-		{
-			int match = -1;
-			for (int i = 0; i < NUM_CMDS; i++)
-			{
-				if (0 == strcmp(cmds[i].text, cliBuffer))
-				{
-					match = i;
-				}
-			}
-
-			if (match >= 0)
-			{
-				clifunc func = cmds[match].func;
-				(*func)();
-			}
-			else
-			{
-				sprintf(szBuffer, "Unrecognised command \"%s\"", cliBuffer);
-				Message(szBuffer);
-			}
-		}
-
-		// Erase old user input
+		// Erase old user input, before Tokenise() splits it up
 		EraseOldUser();
 
+		Execute(cliBuffer);
+
 		cliIndex = 0;
 	}
 	// Backspace
 	else if (DEL == data)
 	{
-		Output("%c", cliBuffer[cliIndex]);
-		cliIndex--;
+		if (cliIndex > 0)
+		{
+			ScreenPrintAt(22, 3 + cliIndex, " ");
+			cliIndex--;
+		}
 		cliBuffer[cliIndex] = 0;
 	}
 	// Escape - Clear screen
@@ -229,32 +509,27 @@ void CLI_ProcessNewData(uint8_t data)
 	{
 		RefreshScreen();
 	}
+	// Line full, ignore until enter or backspace
+	else if (cliIndex >= sizeof(cliBuffer) - 1)
+	{
+		cliBuffer[cliIndex] = 0;
+	}
 	else
 	{
 		cliIndex++;
 
-		char szBuffer[20] = {0};
-
-		sprintf(szBuffer, "%c", data);
-
-		OutputAt(22, 3 + cliIndex, szBuffer);
+		ScreenPrintAt(22, 3 + cliIndex, "%c", data);
 	}
 
-	// Update the screen
+	// Screen is redrawn on the next frame
+	ScreenSetCursor(22, 4 + cliIndex);
     ScreenUpdate();
 }
 
 void EraseOldUser()
 {
-	char szBuffer[100] = {0};
-
 	// Erase old user input
-	for (int i = 0; i < cliIndex; i++)
-	{
-		szBuffer[i] = ' ';
-	}
-	szBuffer[cliIndex] = 0;
-	OutputAt(22, 4, szBuffer);
+	ScreenPrintAt(22, 4, "%*s", cliIndex, "");
 }
 
 uint32_t RxBytesAvailable()
@@ -265,7 +540,17 @@ uint32_t RxBytesAvailable()
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
 {
 	// Copy received byte to buffer
-	CircularBuffer_WriteByte(&rxBuffer, Rx_data);
+	if (!CircularBuffer_WriteByte(&rxBuffer, Rx_data))
+	{
+		typeStats.overruns++;
+	}
+	Scheduler_Signal(EVENT_UART_RX);
+
+	// Time to tell the host to stop
+	if (typing && !flowStopped && (CircularBuffer_StoredItems(&rxBuffer) >= FLOW_STOP))
+	{
+		Deferred_Queue(&txJob);
+	}
 
 	// Set up the next read
 	HAL_UART_Receive_IT(&huart2, &Rx_data, 1);
@@ -273,8 +558,12 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
 
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 {
+	// The UART has finished with the bytes it was sending in place
+	CircularBuffer_Skip(&txBuffer, txLength);
+	txLength       = 0;
 	isTransmitting = false;
-	StartTransmit();
+	Deferred_Queue(&txJob);
+	Scheduler_Signal(EVENT_UART_TX);
 }
 
 bool ReadByte(uint8_t *data)
@@ -286,60 +575,480 @@ bool ReadByte(uint8_t *data)
 // Private Function definitions
 ///////////////////////////////////////////////////////////////////////////////
 
-static void Help(void)
+// Binary search of cmds[]
+static const COMMAND *FindCommand(const char *text)
 {
-	Output("Commands :\r\n");
+	int low  = 0;
+	int high = NUM_CMDS - 1;
 
-	for (int i = 0; i < NUM_CMDS; i++)
+	while (low <= high)
 	{
-		Output("%s\r\n", cmds[i].text);
+		int mid    = (low + high) / 2;
+		int result = strcmp(text, cmds[mid].text);
+
+		if (0 == result)
+		{
+			return &cmds[mid];
+		}
+		else if (result < 0)
+		{
+			high = mid - 1;
+		}
+		else
+		{
+			low = mid + 1;
+		}
 	}
+
+	return NULL;
 }
 
-static void Test1(void)
+// Split a line in place into space separated arguments, double quotes
+// group words into one argument
+static int Tokenise(char *line, char *argv[])
+{
+	int argc = 0;
+
+	while (*line)
+	{
+		// Skip separators
+		while (' ' == *line)
+		{
+			*line++ = 0;
+		}
+
+		if (0 == *line)
+		{
+			break;
+		}
+
+		if (argc >= MAX_ARGS)
+		{
+			return -1;
+		}
+
+		if ('"' == *line)
+		{
+			argv[argc++] = ++line;
+			while (*line && '"' != *line)
+			{
+				line++;
+			}
+			if ('"' == *line)
+			{
+				*line++ = 0;
+			}
+		}
+		else
+		{
+			argv[argc++] = line;
+			while (*line && ' ' != *line)
+			{
+				line++;
+			}
+		}
+	}
+
+	return argc;
+}
+
+static void Execute(char *line)
+{
+	char          *argv[MAX_ARGS];
+	int           argc = Tokenise(line, argv);
+	const COMMAND *command;
+
+	if (0 == argc)
+	{
+		return;
+	}
+
+	if (argc < 0)
+	{
+		Message("Too many arguments");
+		return;
+	}
+
+	command = FindCommand(argv[0]);
+
+	if (NULL == command)
+	{
+		Message("Unrecognised command \"%s\"", argv[0]);
+	}
+	else if ((argc - 1 < command->minArgs) ||
+	         (argc - 1 > command->maxArgs) ||
+	         (CLI_ERROR_ARGS == command->func(argc, argv)))
+	{
+		Message("Usage : %s %s", command->text, command->usage);
+	}
+}
+
+static bool HelpProducer(uint32_t step)
+{
+	if (0 == step)
+	{
+		Output("Commands :\r\n");
+	}
+	else
+	{
+		Output("%-10s %-20s %s\r\n", cmds[step - 1].text, cmds[step - 1].usage, cmds[step - 1].help);
+	}
+
+	return (step >= NUM_CMDS);
+}
+
+// Clear the message line once it has been shown for a while
+static void MessageExpired(Timer *timer)
+{
+	ScreenPrintAt(23, 3, "%*s", MESSAGE_WIDTH, "");
+	ScreenUpdate();
+}
+
+static int Help(int argc, char *argv[])
+{
+	if (argc > 1)
+	{
+		const COMMAND *command = FindCommand(argv[1]);
+
+		if (NULL == command)
+		{
+			Message("Unrecognised command \"%s\"", argv[1]);
+			return CLI_ERROR;
+		}
+
+		Output("%s %s\r\n  %s\r\n", command->text, command->usage, command->help);
+	}
+	else if (!CLI_StartProducer(HelpProducer))
+	{
+		Message("Output busy, try again");
+		return CLI_ERROR;
+	}
+
+	return CLI_OK;
+}
+
+static int SetOutput(int argc, char *argv[])
+{
+	if (argc > 1)
+	{
+		int policy = CLI_ParseChoice(argv[1], policyNames, sizeof(policyNames) / sizeof(policyNames[0]));
+
+		if (policy < 0)
+		{
+			return CLI_ERROR_ARGS;
+		}
+
+		CLI_SetOutputPolicy((OutputPolicy)policy);
+	}
+
+	Message("Output policy : %s", policyNames[outputPolicy]);
+
+	return CLI_OK;
+}
+
+static int Test1(int argc, char *argv[])
 {
 	Output("Test one\r\n");
 
 	Output("Test one - [done]\r\n");
+
+	return CLI_OK;
 }
 
-static void Test2(void)
+static int Test2(int argc, char *argv[])
 {
 	Output("Test two\r\n");
 
 	Output("Test two - [done]\r\n");
+
+	return CLI_OK;
 }
 
-static void Test3(void)
+static int Test3(int argc, char *argv[])
 {
 	Output("Test three\r\n");
 
 	Output("Test three - [done]\r\n");
+
+	return CLI_OK;
 }
 
-uint32_t StartTransmit(void)
+static int TypeThrough(int argc, char *argv[])
 {
-	uint32_t storredItems = CircularBuffer_StoredItems(&txBuffer);
-	uint32_t bytesWritten = 0;
+	heldModifier = 0;
+	heldUsage    = 0;
+	typeStarting = true;
+	typing       = true;
 
-	if (!isTransmitting && storredItems > 0)
+	Message("Typing into the host, Ctrl-D to stop");
+
+	return CLI_OK;
+}
+
+static int TxStats(int argc, char *argv[])
+{
+	Output("Policy     : %s\r\n", policyNames[outputPolicy]);
+	Output("Dropped    : %u bytes in %u writes\r\n", txStats.droppedBytes, txStats.droppedWrites);
+	Output("Stalls     : %u\r\n", txStats.stalls);
+	Output("High water : %u / %u\r\n", txStats.highWater, TX_BUFFER_SIZE - 1);
+	Output("Typed      : %u, %u skipped, %u XOFF, %u RX overruns\r\n",
+	       typeStats.typed, typeStats.skipped, typeStats.xoffs, typeStats.overruns);
+
+	return CLI_OK;
+}
+
+// Send the next contiguous block of txBuffer directly from the ring, it is
+// only released once the UART reports the transfer complete. Blocks are
+// capped at TX_CHUNK so an XOFF never waits long behind output. Only ever
+// run as txJob, so it cannot race with itself.
+static void StartTransmit(void *arg)
+{
+	uint8_t  *data;
+	uint32_t length;
+
+	if (!isTransmitting)
 	{
-		for (bytesWritten = 0; (bytesWritten < storredItems) && (bytesWritten < sizeof(UserTxBufferFS - 1)); bytesWritten++)
+		// Flow control goes ahead of any queued output
+		flowChar = FlowControl();
+		if (0 != flowChar)
+		{
+			isTransmitting = true;
+			txLength       = 0;
+
+			if (HAL_OK != HAL_UART_Transmit_IT(&huart2, &flowChar, 1))
+			{
+				isTransmitting = false;
+			}
+			return;
+		}
+
+		length = CircularBuffer_ContiguousItems(&txBuffer, &data);
+		if (length > TX_CHUNK)
 		{
-			CircularBuffer_ReadByte(&txBuffer, &UserTxBufferFS[bytesWritten]);
+			length = TX_CHUNK;
 		}
 
-		if (HAL_OK == HAL_UART_Transmit_IT(&huart2, UserTxBufferFS, bytesWritten))
+		if (length > 0)
 		{
 			isTransmitting = true;
+			txLength       = length;
+
+			if (HAL_OK != HAL_UART_Transmit_IT(&huart2, data, length))
+			{
+				isTransmitting = false;
+				txLength       = 0;
+			}
+		}
+	}
+}
+
+// Which flow control character is due, 0 for none. Runs in PendSV only.
+static uint8_t FlowControl(void)
+{
+	uint32_t stored = CircularBuffer_StoredItems(&rxBuffer);
+
+	if (!flowStopped && typing && (stored >= FLOW_STOP))
+	{
+		flowStopped = true;
+		typeStats.xoffs++;
+		return XOFF;
+	}
+
+	if (flowStopped && (!typing || (stored <= FLOW_START)))
+	{
+		flowStopped = false;
+		return XON;
+	}
+
+	return 0;
+}
+
+// Type received text into the host, as fast as the report queue takes it.
+// What it can not take yet stays in rxBuffer, which holds the host off.
+static void TypeText(void)
+{
+	uint8_t data;
+	uint8_t modifier;
+	uint8_t usage;
+
+	// Room for a release and a press
+	while (typing && (USB_Keyboard_QueueSpace() >= 2) && ReadByte(&data))
+	{
+		if (Protocol_ProcessByte(data) || (CR == data) || (typeStarting && (LF == data)))
+		{
+			typeStarting = false;
+			continue;
+		}
+
+		typeStarting = false;
+
+		if (EOT == data)
+		{
+			StopTyping();
+			break;
+		}
+
+		if (!USB_Keyboard_AsciiToHid((char)data, &modifier, &usage))
+		{
+			typeStats.skipped++;
+			continue;
+		}
+
+		// A different key with the same modifiers can go straight down,
+		// otherwise the last one has to be let go first
+		if ((0 != heldUsage) && ((usage == heldUsage) || (modifier != heldModifier)))
+		{
+			USB_Keyboard_QueueReport(HID_SOURCE_TYPE, 0, &heldUsage, 0);
+		}
+
+		USB_Keyboard_QueueReport(HID_SOURCE_TYPE, modifier, &usage, 1);
+		heldModifier = modifier;
+		heldUsage    = usage;
+		typeStats.typed++;
+	}
+
+	// Nothing more to type yet, do not leave the key down to auto repeat
+	if ((0 != heldUsage) && (0 == RxBytesAvailable()) && (USB_Keyboard_QueueSpace() >= 1))
+	{
+		USB_Keyboard_QueueReport(HID_SOURCE_TYPE, 0, &heldUsage, 0);
+		heldUsage = 0;
+	}
+
+	// Room again, let the host carry on
+	if (flowStopped && (CircularBuffer_StoredItems(&rxBuffer) <= FLOW_START))
+	{
+		Deferred_Queue(&txJob);
+	}
+}
+
+static void StopTyping(void)
+{
+	typing = false;
+
+	// Let go of the key, it goes later if the report queue is full
+	if (0 != heldUsage)
+	{
+		USB_Keyboard_QueueReport(HID_SOURCE_TYPE, 0, &heldUsage, 0);
+		heldUsage = 0;
+	}
+
+	Deferred_Queue(&txJob);
+	Message("Type-through stopped, %u typed", typeStats.typed);
+}
+
+static void TxBegin(TxWriter *writer)
+{
+	writer->free     = CircularBuffer_FreeItems(&txBuffer);
+	writer->count    = 0;
+	writer->dropping = false;
+}
+
+static bool TxSink(void *context, char c)
+{
+	TxWriter *writer = (TxWriter *)context;
+
+	if ((writer->count >= writer->free) && !writer->dropping)
+	{
+		if (OUTPUT_POLICY_DROP != outputPolicy)
+		{
+			// Let the UART have what we have so far and wait for more room
+			CircularBuffer_Commit(&txBuffer, writer->count);
+			writer->count = 0;
+			Deferred_Queue(&txJob);
+
+			writer->dropping = !WaitForSpace();
+			writer->free     = CircularBuffer_FreeItems(&txBuffer);
 		}
 		else
 		{
-			bytesWritten = 0;
+			// Drop the whole write so no partial escape sequence goes out
+			writer->dropping = true;
+			txStats.droppedBytes += writer->count;
+		}
+
+		if (writer->dropping)
+		{
+			txStats.droppedWrites++;
 		}
 	}
 
-	return bytesWritten;
+	if (writer->dropping)
+	{
+		txStats.droppedBytes++;
+	}
+	else
+	{
+		CircularBuffer_Poke(&txBuffer, writer->count++, (uint8_t)c);
+	}
+
+	// Keep formatting even when dropping so the lost bytes are counted
+	return true;
+}
+
+static void TxEnd(TxWriter *writer)
+{
+	uint32_t stored;
+
+	if (!writer->dropping)
+	{
+		CircularBuffer_Commit(&txBuffer, writer->count);
+	}
+
+	stored = CircularBuffer_StoredItems(&txBuffer);
+	if (stored > txStats.highWater)
+	{
+		txStats.highWater = stored;
+	}
+
+	Deferred_Queue(&txJob);
+}
+
+// Wait for the UART to drain some of txBuffer, letting the more important
+// tasks run meanwhile so timers, keys and macros are not held up. Gives up in
+// interrupt context, where the UART interrupt may not be able to run, or if
+// nothing drains.
+static bool WaitForSpace(void)
+{
+	uint32_t start = HAL_GetTick();
+	bool     ret   = true;
+
+	if (0 != __get_IPSR())
+	{
+		return false;
+	}
+
+	txStats.stalls++;
+
+	// The TX complete interrupt keeps the UART going by itself
+	while (0 == CircularBuffer_FreeItems(&txBuffer))
+	{
+		if ((HAL_GetTick() - start) > TX_BLOCK_TIMEOUT)
+		{
+			ret = false;
+			break;
+		}
+
+		Scheduler_Yield();
+	}
+
+	return ret;
+}
+
+// Cursor move and text go out as a single reservation in txBuffer
+static uint32_t VOutputAt(int x, int y, const char *format, va_list args)
+{
+	TxWriter	writer;
+	uint32_t	length;
+
+	TxBegin(&writer);
+
+	// [ *l ; *c H	Move cursor to line *l, column *c
+	// [ *l ; *c f	Move curosr to line *l, column *c
+	Format_Print(TxSink, &writer, "\033[%d;%dH", x, y);
+	length = Format_VPrint(TxSink, &writer, format, args);
+	TxEnd(&writer);
+
+	return length;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -93,3 +93,66 @@ bool CircularBuffer_ReadByte(CircularBuffer_t* buffer, uint8_t* b)
 
     return ret;
 }
+
+uint32_t CircularBuffer_FreeItems(CircularBuffer_t* buffer)
+{
+    // One slot is always left empty so full and empty can be told apart
+    return buffer->maxItems - 1 - CircularBuffer_StoredItems(buffer);
+}
+
+// Write a byte into reserved space without making it visible to the reader,
+// offset must be less than CircularBuffer_FreeItems()
+void CircularBuffer_Poke(CircularBuffer_t* buffer, uint32_t offset, uint8_t b)
+{
+    uint32_t index = buffer->writeIndex + offset;
+
+    if (index >= buffer->maxItems)
+    {
+        index -= buffer->maxItems;
+    }
+
+    buffer->items[index] = b;
+}
+
+// Publish bytes previously written with CircularBuffer_Poke()
+void CircularBuffer_Commit(CircularBuffer_t* buffer, uint32_t count)
+{
+    uint32_t index = buffer->writeIndex + count;
+
+    if (index >= buffer->maxItems)
+    {
+        index -= buffer->maxItems;
+    }
+
+    buffer->writeIndex = index;
+}
+
+// Return the stored bytes that can be read without wrapping
+uint32_t CircularBuffer_ContiguousItems(CircularBuffer_t* buffer, uint8_t** data)
+{
+    uint32_t writeIndex = buffer->writeIndex;
+
+    (*data) = &buffer->items[buffer->readIndex];
+
+    if (writeIndex >= buffer->readIndex)
+    {
+        return writeIndex - buffer->readIndex;
+    }
+    else
+    {
+        return buffer->maxItems - buffer->readIndex;
+    }
+}
+
+// Discard bytes that have been consumed in place
+void CircularBuffer_Skip(CircularBuffer_t* buffer, uint32_t count)
+{
+    uint32_t index = buffer->readIndex + count;
+
+    if (index >= buffer->maxItems)
+    {
+        index -= buffer->maxItems;
+    }
+
+    buffer->readIndex = index;
+}
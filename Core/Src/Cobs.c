@@ -0,0 +1,107 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Cobs.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Consistent Overhead Byte Stuffing
+///
+///             Removes every zero from a block of data so that zero can be
+///             used to mark the start and end of a frame. No HAL use so the
+///             same code can be built for a host tool.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include "Cobs.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Encode a block of data, the delimiters are not added
+///
+/// @param   src    - Data to encode
+/// @param   length - Number of bytes in src
+/// @param   dst    - Receives COBS_MAX_ENCODED(length) bytes at most
+///
+/// @return  Number of bytes written to dst
+///////////////////////////////////////////////////////////////////////////////
+uint32_t Cobs_Encode(const uint8_t *src, uint32_t length, uint8_t *dst)
+{
+	uint32_t codeIndex = 0;
+	uint32_t out       = 1;
+	uint8_t  code      = 1;
+
+	for (uint32_t i = 0; i < length; i++)
+	{
+		if (0 == src[i])
+		{
+			dst[codeIndex] = code;
+			codeIndex      = out++;
+			code           = 1;
+		}
+		else
+		{
+			dst[out++] = src[i];
+			code++;
+
+			// Longest run, start a new block
+			if (0xFF == code)
+			{
+				dst[codeIndex] = code;
+				codeIndex      = out++;
+				code           = 1;
+			}
+		}
+	}
+
+	dst[codeIndex] = code;
+
+	return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Decode a block of data without its delimiters, src and dst may
+///          be the same buffer
+///
+/// @param   src    - Encoded data
+/// @param   length - Number of bytes in src
+/// @param   dst    - Receives at most length - 1 bytes
+///
+/// @return  Number of bytes decoded, or -1 if src is not valid COBS
+///////////////////////////////////////////////////////////////////////////////
+int32_t Cobs_Decode(const uint8_t *src, uint32_t length, uint8_t *dst)
+{
+	uint32_t in  = 0;
+	uint32_t out = 0;
+
+	while (in < length)
+	{
+		uint8_t code = src[in++];
+
+		if ((0 == code) || ((in + code - 1) > length))
+		{
+			return -1;
+		}
+
+		for (uint8_t i = 1; i < code; i++)
+		{
+			if (0 == src[in])
+			{
+				return -1;
+			}
+			dst[out++] = src[in++];
+		}
+
+		// A short block stands for a zero, unless it ends the data
+		if ((code < 0xFF) && (in < length))
+		{
+			dst[out++] = 0;
+		}
+	}
+
+	return (int32_t)out;
+}
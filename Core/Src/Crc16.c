@@ -0,0 +1,50 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Crc16.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      CRC16 CCITT (polynomial 0x1021, initial value 0xFFFF)
+///
+///             Uses a 16 entry nibble table, small enough to sit in flash
+///             next to the code and twice as fast as bit at a time.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include "Crc16.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static const uint16_t nibbleTable[16] =
+{
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Add data to a running CRC
+///
+/// @param   crc    - CRC so far, CRC16_INIT to start
+/// @param   data   - Bytes to add
+/// @param   length - Number of bytes
+///
+/// @return  Updated CRC
+///////////////////////////////////////////////////////////////////////////////
+uint16_t Crc16_Update(uint16_t crc, const uint8_t *data, uint32_t length)
+{
+	while (length--)
+	{
+		crc = (uint16_t)((crc << 4) ^ nibbleTable[(crc >> 12) ^ (*data >> 4)]);
+		crc = (uint16_t)((crc << 4) ^ nibbleTable[(crc >> 12) ^ (*data & 0x0F)]);
+		data++;
+	}
+
+	return crc;
+}
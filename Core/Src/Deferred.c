@@ -0,0 +1,141 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Deferred.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Deferred work, the bottom half of the interrupt handlers
+///
+///             Interrupt handlers only capture their data and queue a job.
+///             Queuing pends PendSV, which has the lowest priority, so the
+///             jobs run in order once every other interrupt has finished but
+///             before returning to the scheduler tasks. Jobs never run
+///             concurrently with each other.
+///
+///             Interrupt priorities, preemption only (NVIC_PRIORITYGROUP_4) :
+///
+///                 0  SysTick  - HAL_GetTick() must work everywhere
+///                 1  OTG_FS   - USB
+///                 2  USART2   - One byte every 87us at 115200
+///                 3  TIM3     - Rotary encoder
+///                 4  EXTI     - Spare
+///                 15 PendSV   - Deferred jobs
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+
+#include "stm32f4xx_hal.h"
+
+#include "Deferred.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static Deferred			*head = NULL;
+static Deferred			*tail = NULL;
+static DeferredStats_t	stats = {0};
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set up a job before first use
+///
+/// @param   job  - Job to set up
+/// @param   func - Run from PendSV each time the job is queued
+/// @param   arg  - Passed to func
+///////////////////////////////////////////////////////////////////////////////
+void Deferred_Init(Deferred *job, DeferredFunc func, void *arg)
+{
+	job->next    = NULL;
+	job->func    = func;
+	job->arg     = arg;
+	job->pending = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Ask for a job to be run, safe to call from any context
+///////////////////////////////////////////////////////////////////////////////
+void Deferred_Queue(Deferred *job)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+
+	if (job->pending)
+	{
+		stats.merged++;
+	}
+	else
+	{
+		job->pending = true;
+		job->next    = NULL;
+
+		if (NULL == tail)
+		{
+			head = job;
+		}
+		else
+		{
+			tail->next = job;
+		}
+		tail = job;
+
+		stats.queued++;
+	}
+
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+
+	__set_PRIMASK(primask);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Run every queued job, called from PendSV_Handler()
+///////////////////////////////////////////////////////////////////////////////
+void Deferred_Run(void)
+{
+	uint32_t start = DWT->CYCCNT;
+	uint32_t cycles;
+	Deferred *job;
+
+	for (;;)
+	{
+		__disable_irq();
+		job = head;
+		if (NULL != job)
+		{
+			head = job->next;
+			if (NULL == head)
+			{
+				tail = NULL;
+			}
+
+			// Cleared first, the job may be queued again while it runs
+			job->pending = false;
+		}
+		__enable_irq();
+
+		if (NULL == job)
+		{
+			break;
+		}
+
+		job->func(job->arg);
+		stats.runs++;
+	}
+
+	cycles = DWT->CYCCNT - start;
+	if (cycles > stats.maxCycles)
+	{
+		stats.maxCycles = cycles;
+	}
+}
+
+const DeferredStats_t *Deferred_GetStats(void)
+{
+	return &stats;
+}
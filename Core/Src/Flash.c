@@ -0,0 +1,155 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Flash.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Flash sector erase that keeps the keypad running
+///
+///             The F407 has a single flash bank, so while a sector is being
+///             erased (1 to 2 seconds for 128K) any read of flash stalls the
+///             core. To keep USB, the UART and the keys alive :
+///
+///               - the vector table is copied to RAM
+///               - the interrupt handlers and everything they call (USB
+///                 stack, UART, HID report queue, deferred jobs, SysTick)
+///                 are linked into the .ramcode section, which the startup
+///                 code copies to RAM along with .data
+///               - the erase itself runs from RAM, sampling the keys while
+///                 it waits so a press during the erase is not lost
+///
+///             The encoder interrupt is held off, its counter keeps going in
+///             hardware. Only the scheduler tasks wait for the erase to end.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <string.h>
+
+#include "stm32f4xx_hal.h"
+
+#include "Flash.h"
+#include "usb_hid_keyboard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define NUM_VECTORS		(16 + FPU_IRQn + 1)
+
+#define FLASH_ERRORS	(FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR)
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static void FlushCaches(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// VTOR needs the table aligned to its size rounded up to a power of 2
+static uint32_t		ramVectors[NUM_VECTORS] __attribute__((aligned(512)));
+
+static FlashStats_t	stats = {0};
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Move the vector table to RAM. Call first thing in main(), before
+///          any interrupt is enabled.
+///////////////////////////////////////////////////////////////////////////////
+void Flash_Init(void)
+{
+	memcpy(ramVectors, (const void *)SCB->VTOR, sizeof(ramVectors));
+
+	__disable_irq();
+	SCB->VTOR = (uint32_t)ramVectors;
+	__DSB();
+	__enable_irq();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Erase one sector. Interrupts keep being serviced from RAM and the
+///          keys are sampled while the erase runs.
+///
+/// @param   sector - FLASH_SECTOR_xx
+///
+/// @return  false if the flash reported an error
+///////////////////////////////////////////////////////////////////////////////
+__RAM_FUNC bool Flash_EraseSector(uint32_t sector)
+{
+	uint32_t start   = HAL_GetTick();
+	uint32_t encoder = NVIC_GetEnableIRQ(TIM3_IRQn);
+	uint32_t status;
+
+	NVIC_DisableIRQ(TIM3_IRQn);
+
+	while (FLASH->SR & FLASH_SR_BSY)
+	{
+	}
+
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	FLASH->SR   = FLASH_ERRORS | FLASH_SR_EOP;
+
+	FLASH->CR = FLASH_PSIZE_WORD | FLASH_CR_SER | (sector << FLASH_CR_SNB_Pos);
+	FLASH->CR |= FLASH_CR_STRT;
+
+	// Nothing in here may touch flash
+	while (FLASH->SR & FLASH_SR_BSY)
+	{
+		USB_Keyboard_Sample();
+	}
+
+	status     = FLASH->SR & FLASH_ERRORS;
+	FLASH->SR  = FLASH_ERRORS | FLASH_SR_EOP;
+	FLASH->CR  = FLASH_CR_LOCK;
+
+	FlushCaches();
+
+	if (encoder)
+	{
+		NVIC_EnableIRQ(TIM3_IRQn);
+	}
+
+	stats.erases++;
+	stats.lastMs = HAL_GetTick() - start;
+	if (stats.lastMs > stats.maxMs)
+	{
+		stats.maxMs = stats.lastMs;
+	}
+
+	return (0 == status);
+}
+
+const FlashStats_t *Flash_GetStats(void)
+{
+	return &stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// The ART caches may still hold what the sector used to contain
+__RAM_FUNC static void FlushCaches(void)
+{
+	if (FLASH->ACR & FLASH_ACR_DCEN)
+	{
+		FLASH->ACR &= ~FLASH_ACR_DCEN;
+		FLASH->ACR |= FLASH_ACR_DCRST;
+		FLASH->ACR &= ~FLASH_ACR_DCRST;
+		FLASH->ACR |= FLASH_ACR_DCEN;
+	}
+
+	if (FLASH->ACR & FLASH_ACR_ICEN)
+	{
+		FLASH->ACR &= ~FLASH_ACR_ICEN;
+		FLASH->ACR |= FLASH_ACR_ICRST;
+		FLASH->ACR &= ~FLASH_ACR_ICRST;
+		FLASH->ACR |= FLASH_ACR_ICEN;
+	}
+}
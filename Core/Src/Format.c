@@ -0,0 +1,318 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Format.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Lightweight printf style formatter
+///
+///             Characters are handed one at a time to a sink so the caller
+///             decides where they go (ring buffer, screen memory...). Only
+///             the conversions the firmware uses are supported :
+///             %d %i %u %x %X %c %s %% with '-' and '0' flags, width and
+///             precision (both may be '*'). 'l' and 'h' are accepted and
+///             ignored as int is 32 bits on this target.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+
+#include "Format.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define FLAG_LEFT		0x01
+#define FLAG_ZERO		0x02
+
+#define MAX_DIGITS		10		// 2^32 in decimal
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	FormatSink	sink;
+	void		*context;
+	uint32_t	count;
+	bool		stopped;
+} FormatState;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static void PutChar(FormatState *state, char c);
+static void PutRepeat(FormatState *state, char c, int count);
+static void PutNumber(FormatState *state, uint32_t value, bool negative, uint32_t base,
+                      bool upper, uint8_t flags, int width);
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Format text, passing each character to a sink
+///
+/// @param   sink    - Receives the output characters
+/// @param   context - Passed unchanged to the sink
+/// @param   format  - printf style format string
+/// @param   args    - Arguments for the format string
+///
+/// @return  Number of characters accepted by the sink
+///////////////////////////////////////////////////////////////////////////////
+uint32_t Format_VPrint(FormatSink sink, void *context, const char *format, va_list args)
+{
+	FormatState state = {sink, context, 0, false};
+
+	while (*format && !state.stopped)
+	{
+		if ('%' != *format)
+		{
+			PutChar(&state, *format++);
+			continue;
+		}
+		format++;
+
+		// Flags
+		uint8_t flags = 0;
+		for (;;)
+		{
+			if ('-' == *format)
+			{
+				flags |= FLAG_LEFT;
+			}
+			else if ('0' == *format)
+			{
+				flags |= FLAG_ZERO;
+			}
+			else
+			{
+				break;
+			}
+			format++;
+		}
+
+		// Width
+		int width = 0;
+		if ('*' == *format)
+		{
+			width = va_arg(args, int);
+			if (width < 0)
+			{
+				flags |= FLAG_LEFT;
+				width  = -width;
+			}
+			format++;
+		}
+		while (*format >= '0' && *format <= '9')
+		{
+			width = (width * 10) + (*format++ - '0');
+		}
+
+		// Precision
+		int precision = -1;
+		if ('.' == *format)
+		{
+			format++;
+			precision = 0;
+			if ('*' == *format)
+			{
+				precision = va_arg(args, int);
+				format++;
+			}
+			while (*format >= '0' && *format <= '9')
+			{
+				precision = (precision * 10) + (*format++ - '0');
+			}
+		}
+
+		// Length modifiers, all 32 bits here
+		while ('l' == *format || 'h' == *format)
+		{
+			format++;
+		}
+
+		switch (*format)
+		{
+		case 'd':
+		case 'i':
+		{
+			int32_t value = va_arg(args, int32_t);
+			if (value < 0)
+			{
+				PutNumber(&state, (uint32_t)0 - (uint32_t)value, true, 10, false, flags, width);
+			}
+			else
+			{
+				PutNumber(&state, (uint32_t)value, false, 10, false, flags, width);
+			}
+			break;
+		}
+
+		case 'u':
+			PutNumber(&state, va_arg(args, uint32_t), false, 10, false, flags, width);
+			break;
+
+		case 'x':
+		case 'X':
+			PutNumber(&state, va_arg(args, uint32_t), false, 16, ('X' == *format), flags, width);
+			break;
+
+		case 'c':
+			if (!(flags & FLAG_LEFT))
+			{
+				PutRepeat(&state, ' ', width - 1);
+			}
+			PutChar(&state, (char)va_arg(args, int));
+			if (flags & FLAG_LEFT)
+			{
+				PutRepeat(&state, ' ', width - 1);
+			}
+			break;
+
+		case 's':
+		{
+			const char *text = va_arg(args, const char *);
+			int         length = 0;
+
+			if (NULL == text)
+			{
+				text = "(null)";
+			}
+			while (text[length] && (precision < 0 || length < precision))
+			{
+				length++;
+			}
+
+			if (!(flags & FLAG_LEFT))
+			{
+				PutRepeat(&state, ' ', width - length);
+			}
+			for (int i = 0; i < length; i++)
+			{
+				PutChar(&state, text[i]);
+			}
+			if (flags & FLAG_LEFT)
+			{
+				PutRepeat(&state, ' ', width - length);
+			}
+			break;
+		}
+
+		case '%':
+			PutChar(&state, '%');
+			break;
+
+		case 0:
+			// Format ends part way through a conversion
+			continue;
+
+		default:
+			// Unsupported, show it as is
+			PutChar(&state, '%');
+			PutChar(&state, *format);
+			break;
+		}
+		format++;
+	}
+
+	return state.count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Variable argument version of Format_VPrint()
+///////////////////////////////////////////////////////////////////////////////
+uint32_t Format_Print(FormatSink sink, void *context, const char *format, ...)
+{
+	va_list  args;
+	uint32_t count;
+
+	va_start(args, format);
+	count = Format_VPrint(sink, context, format, args);
+	va_end(args);
+
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static void PutChar(FormatState *state, char c)
+{
+	if (!state->stopped)
+	{
+		if (state->sink(state->context, c))
+		{
+			state->count++;
+		}
+		else
+		{
+			state->stopped = true;
+		}
+	}
+}
+
+static void PutRepeat(FormatState *state, char c, int count)
+{
+	while (count-- > 0)
+	{
+		PutChar(state, c);
+	}
+}
+
+static void PutNumber(FormatState *state, uint32_t value, bool negative, uint32_t base,
+                      bool upper, uint8_t flags, int width)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char        buffer[MAX_DIGITS];
+	int         length = 0;
+
+	// Digits come out least significant first
+	do
+	{
+		buffer[length++] = digits[value % base];
+		value /= base;
+	} while (value > 0);
+
+	int padding = width - length - (negative ? 1 : 0);
+
+	if (flags & FLAG_LEFT)
+	{
+		if (negative)
+		{
+			PutChar(state, '-');
+		}
+		while (length > 0)
+		{
+			PutChar(state, buffer[--length]);
+		}
+		PutRepeat(state, ' ', padding);
+	}
+	else if (flags & FLAG_ZERO)
+	{
+		if (negative)
+		{
+			PutChar(state, '-');
+		}
+		PutRepeat(state, '0', padding);
+		while (length > 0)
+		{
+			PutChar(state, buffer[--length]);
+		}
+	}
+	else
+	{
+		PutRepeat(state, ' ', padding);
+		if (negative)
+		{
+			PutChar(state, '-');
+		}
+		while (length > 0)
+		{
+			PutChar(state, buffer[--length]);
+		}
+	}
+}
@@ -0,0 +1,1203 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Keymap.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Key bindings and profiles
+///
+///             A profile binds an action to each key and encoder direction.
+///             Profile 0 is built in, the others are uploaded by the host and
+///             kept in the flash store.
+///
+///             Each profile has KEYMAP_LAYERS layers. An input resolves to the
+///             action on the highest active layer that binds it, layer 0 is
+///             always active. Layer actions switch layers on and off :
+///
+///               - momentary, while the key is held
+///               - toggle, on until pressed again or the profile changes
+///               - one shot, for the next key press only
+///
+///             So five keys and an encoder can reach KEYMAP_LAYERS x 7
+///             bindings.
+///
+///             A tap hold key plays a macro when tapped and acts as a layer
+///             or modifier when held. Once it goes down the events that
+///             follow wait until it is decided :
+///
+///               - released first, a tap
+///               - still down after the tapping term, a hold
+///               - another key tapped inside it, a hold if permissive hold
+///               - another key pressed, a hold if hold on other key
+///
+///             then run in order. The tapping term is a timer, nothing is
+///             polled, and with no tap hold key undecided events go straight
+///             through, so other keys lose no time.
+///
+///             Ahead of all that, a combo is two or more keys pressed within
+///             the combo term of the first, giving an action of its own. Each
+///             profile keeps, for each key, a bit set of the combos that have
+///             it, worked out when the profile is loaded. The combos still
+///             possible are the AND of the sets of the keys pressed so far,
+///             one word per 32 combos. A key in no combo is not held up.
+///
+///             The leader key starts a sequence of keys matched against the
+///             profile's leader trie, see Keymap.h. The trie is walked in
+///             place in the flash store, pinned while a sequence runs. Each
+///             key is one indexed read of the current node, and a node with
+///             nowhere else to go acts straight away, so only a sequence
+///             that is the start of a longer one waits for the timeout.
+///
+///             The active profile is one of two buffers. A new one is built
+///             in the other buffer and switched to by changing one pointer.
+///             Key events are handled in task context, the same as anything
+///             that loads a profile, so an event never sees half a profile.
+///             The action a key was pressed with is kept until it is
+///             released, so a switch while keys are down does not lose or
+///             mix up their events.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+#include <string.h>
+
+#include "Keymap.h"
+#include "CLI.h"
+#include "Library.h"
+#include "Macro.h"
+#include "Store.h"
+#include "Timer.h"
+#include "Turbo.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define LAYER_BYTES			(KEYMAP_INPUTS * 2)			// One layer in the store
+#define PROFILE_BYTES		(KEYMAP_LAYERS * LAYER_BYTES)
+
+// Layers past KEYMAP_LAYERS do nothing
+#define LayerBit(l)			(((l) < KEYMAP_LAYERS) ? (uint8_t)(1 << (l)) : 0)
+
+#define IsTapHold(a)		((ACTION_TYPE(a) == ACTION_TAP_LAYER(0, 0)) || (ACTION_TYPE(a) == ACTION_TAP_MOD(0, 0)))
+
+#define MAX_WAITING			8		// Events held up by an undecided tap hold key
+#define COMBO_BYTES			3		// keys(1) action(2) in the store
+
+#define GetU16(p)			((uint16_t)((p)[0] | ((p)[1] << 8)))
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	uint8_t		input;
+	bool		pressed;
+} KeyEvent;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static void           ComboEvent(uint8_t input, bool pressed);
+static void           ComboDecide(void);
+static void           ComboTimeout(Timer *timer);
+static void           LoadCombos(Profile *profile, uint8_t number);
+static void           Dispatch(uint8_t input, bool pressed);
+static void           LeaderStart(void);
+static void           LeaderStep(uint8_t input);
+static void           LeaderEnd(void);
+static void           LeaderTimeout(Timer *timer);
+static void           Handle(uint8_t input, bool pressed);
+static void           Interrupt(uint8_t input, bool pressed);
+static void           Decide(bool hold);
+static void           TapTimeout(Timer *timer);
+static void           Hold(Action action, bool down);
+static Action         Resolve(uint8_t input);
+static void           Perform(Action action, uint8_t input);
+static void           Release(Action action, uint8_t input);
+static void           LoadActions(Profile *profile, const uint8_t *value, uint16_t length);
+static const uint8_t *MacroSlot(uint16_t slot, uint16_t *length);
+static void           ShowAction(const char *name, Action action);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+// Layers not listed are all ACTION_NONE
+static const Profile builtIn =
+{
+	0,
+	{
+		//                  KEY_1            KEY_2            KEY_3            KEY_4            KEY_R            ENC_UP           ENC_DOWN
+		[0] = KEYMAP_LAYOUT(ACTION_MACRO(0), ACTION_MACRO(1), ACTION_MACRO(2), ACTION_MACRO(3), ACTION_MACRO(4), ACTION_MACRO(5), ACTION_MACRO(6)),
+	},
+};
+
+// Macro slots not uploaded yet. Plain text is a valid macro, see Macro.h
+static const char * const defaultMacros[KEYMAP_INPUTS] =
+{
+	"stuff",
+	"wibble",
+	"This is key four",
+	"Hello World",
+	"Rotary",
+	"up",
+	"down",
+};
+
+static const char * const inputNames[KEYMAP_INPUTS] =
+{
+	"KEY_1", "KEY_2", "KEY_3", "KEY_4", "KEY_R", "ENC_UP", "ENC_DOWN",
+};
+
+static Profile					buffers[2];
+static const Profile * volatile	active = &buffers[0];
+
+// What each input was pressed with, until it is released
+static Action					pressedWith[KEYMAP_INPUTS];
+
+// Active layers, bit n for layer n
+static uint8_t					heldLayers;
+static uint8_t					toggledLayers;
+static uint8_t					oneShotLayers;
+
+// The tap hold key being decided, and what has happened since it went down
+static bool						tapPending;
+static uint8_t					tapInput;
+static Timer					tapTimer;
+static KeyEvent					waiting[MAX_WAITING];
+static uint8_t					numWaiting;
+
+// Keys held back while they may still make a combo, in the order pressed
+static bool						comboPending;
+static uint8_t					comboKeys;
+static uint8_t					comboOrder[NUM_KEYS];
+static uint8_t					numComboKeys;
+static uint32_t					candidates;		// Combos comboKeys could still make
+static Timer					comboTimer;
+
+// The combo that fired, it ends when all its keys are up
+static uint8_t					comboHeld;
+static Action					comboAction;
+static uint8_t					comboInput;		// First key pressed, the one it was done for
+
+// The leader sequence being matched
+static bool						leading;
+static const uint8_t			*trie;
+static uint16_t					numNodes;
+static uint16_t					node;
+static uint8_t					lastInput;
+static Timer					leaderTimer;
+
+static uint32_t					comboTerm     = KEYMAP_COMBO_TERM;
+static uint32_t					tappingTerm   = KEYMAP_TAPPING_TERM;
+static uint32_t					leaderTimeout = KEYMAP_LEADER_TIMEOUT;
+static uint8_t					tapMode     = 0;
+static uint8_t					modifiers;		// Held by tap hold keys
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+void Keymap_Init(void)
+{
+	buffers[0] = builtIn;
+	active     = &buffers[0];
+
+	for (uint8_t i = 0; i < KEYMAP_INPUTS; i++)
+	{
+		pressedWith[i] = ACTION_NONE;
+	}
+
+	heldLayers    = 0;
+	toggledLayers = 0;
+	oneShotLayers = 0;
+
+	tapPending = false;
+	numWaiting = 0;
+	modifiers  = 0;
+	Timer_Init(&tapTimer, TapTimeout, NULL);
+
+	comboPending = false;
+	comboKeys    = 0;
+	comboHeld    = 0;
+	Timer_Init(&comboTimer, ComboTimeout, NULL);
+
+	leading = false;
+	Timer_Init(&leaderTimer, LeaderTimeout, NULL);
+
+	// Profile 0 may have been replaced, or given combos
+	Keymap_Load(0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Switch to a profile
+///
+/// @param   number - 0 to KEYMAP_PROFILES - 1
+///
+/// @return  false if the profile has not been uploaded
+///////////////////////////////////////////////////////////////////////////////
+bool Keymap_Load(uint8_t number)
+{
+	Profile       *spare = (active == &buffers[0]) ? &buffers[1] : &buffers[0];
+	const uint8_t *value;
+	uint16_t      length = 0;
+
+	if (number >= KEYMAP_PROFILES)
+	{
+		return false;
+	}
+
+	value = Store_Get(STORE_KEY_PROFILE(number), &length);
+
+	if (NULL != value)
+	{
+		spare->number = number;
+		LoadActions(spare, value, length);
+	}
+	else if (0 == number)
+	{
+		*spare = builtIn;
+	}
+	else
+	{
+		return false;
+	}
+
+	LoadCombos(spare, number);
+
+	// Candidates are numbered by the old profile's combos
+	if (comboPending)
+	{
+		ComboDecide();
+	}
+
+	active = spare;
+
+	// Layers held down stay, they are released with their key
+	toggledLayers = 0;
+	oneShotLayers = 0;
+
+	return true;
+}
+
+uint8_t Keymap_GetProfile(void)
+{
+	return active->number;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Save one layer of a profile, switching to it again if it is in use
+///
+///          The profile is stored as layer 0 onwards, LAYER_BYTES each. Layers
+///          past the end of what has been saved are ACTION_NONE. The first
+///          layer saved to profile 0 keeps the built in layers it does not
+///          replace.
+///
+/// @param   number  - 0 to KEYMAP_PROFILES - 1, 0 replaces the built in one
+/// @param   layer   - 0 to KEYMAP_LAYERS - 1
+/// @param   actions - KEYMAP_INPUTS actions, 16 bit little endian
+/// @param   length  - Bytes in actions
+///
+/// @return  false if the layer is bad or could not be saved
+///////////////////////////////////////////////////////////////////////////////
+bool Keymap_SetLayer(uint8_t number, uint8_t layer, const uint8_t *actions, uint16_t length)
+{
+	uint8_t       value[PROFILE_BYTES];
+	const uint8_t *old;
+	uint16_t      oldLength = 0;
+	uint16_t      newLength = (layer + 1) * LAYER_BYTES;
+
+	if ((number >= KEYMAP_PROFILES) || (layer >= KEYMAP_LAYERS) || (LAYER_BYTES != length))
+	{
+		return false;
+	}
+
+	memset(value, 0, sizeof(value));
+
+	old = Store_Get(STORE_KEY_PROFILE(number), &oldLength);
+	if (NULL != old)
+	{
+		oldLength = (oldLength > PROFILE_BYTES) ? PROFILE_BYTES : oldLength;
+		memcpy(value, old, oldLength);
+		newLength = (oldLength > newLength) ? oldLength : newLength;
+	}
+	else if (0 == number)
+	{
+		// Replacing the built in profile, not starting an empty one
+		const Action *from = &builtIn.actions[0][0];
+
+		for (uint16_t i = 0; i < (KEYMAP_LAYERS * KEYMAP_INPUTS); i++)
+		{
+			value[i * 2]       = (uint8_t)from[i];
+			value[(i * 2) + 1] = (uint8_t)(from[i] >> 8);
+		}
+	}
+
+	memcpy(&value[layer * LAYER_BYTES], actions, LAYER_BYTES);
+
+	if (!Store_Put(STORE_KEY_PROFILE(number), value, newLength))
+	{
+		return false;
+	}
+
+	if (number == active->number)
+	{
+		Keymap_Load(number);
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   A key has been pressed or released, or the encoder turned
+///
+/// @param   input   - KEY_1 to KEY_R, or KEYMAP_ENCODER_xxx
+/// @param   pressed - true when it goes down
+///////////////////////////////////////////////////////////////////////////////
+void Keymap_Event(uint8_t input, bool pressed)
+{
+	if (input >= KEYMAP_INPUTS)
+	{
+		return;
+	}
+
+	uint8_t bit = (input < NUM_KEYS) ? (1 << input) : 0;
+
+	if (comboPending || (comboHeld & bit) || (pressed && bit && (0 != active->containing[input])))
+	{
+		ComboEvent(input, pressed);
+	}
+	else
+	{
+		Dispatch(input, pressed);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Forget keys held back for a combo, tap hold key or leader
+///          sequence without acting on them, for USB_Keyboard_Panic()
+///////////////////////////////////////////////////////////////////////////////
+void Keymap_Cancel(void)
+{
+	Timer_Stop(&comboTimer);
+	comboPending = false;
+	comboKeys    = 0;
+	numComboKeys = 0;
+
+	Timer_Stop(&tapTimer);
+	tapPending = false;
+	numWaiting = 0;
+
+	if (leading)
+	{
+		LeaderEnd();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Save a combo to a profile, switching to it again if it is in use
+///
+/// @param   number - 0 to KEYMAP_PROFILES - 1
+/// @param   keys   - Bit n for key n, at least two keys
+/// @param   action - ACTION_xxx, ACTION_NONE removes the combo. Tap hold
+///                   actions do nothing in a combo.
+///
+/// @return  false if the combo is bad, the profile is full or the store
+///          could not save it
+///////////////////////////////////////////////////////////////////////////////
+bool Keymap_SetCombo(uint8_t number, uint8_t keys, Action action)
+{
+	uint8_t       value[KEYMAP_COMBOS * COMBO_BYTES];
+	const uint8_t *old;
+	uint16_t      length = 0;
+	uint16_t      at;
+
+	// Two or more keys
+	if ((number >= KEYMAP_PROFILES) || (keys >= (1 << NUM_KEYS)) || (0 == (keys & (keys - 1))))
+	{
+		return false;
+	}
+
+	old = Store_Get(STORE_KEY_COMBOS(number), &length);
+	if (NULL != old)
+	{
+		length = (length > sizeof(value)) ? sizeof(value) : length - (length % COMBO_BYTES);
+		memcpy(value, old, length);
+	}
+	else
+	{
+		length = 0;
+	}
+
+	for (at = 0; (at < length) && (keys != value[at]); at += COMBO_BYTES)
+	{
+	}
+
+	if (ACTION_NONE == action)
+	{
+		if (at < length)
+		{
+			length -= COMBO_BYTES;
+			memmove(&value[at], &value[at + COMBO_BYTES], length - at);
+		}
+	}
+	else if (at < sizeof(value))
+	{
+		value[at]     = keys;
+		value[at + 1] = (uint8_t)action;
+		value[at + 2] = (uint8_t)(action >> 8);
+		length        = (at == length) ? (length + COMBO_BYTES) : length;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (!Store_Put(STORE_KEY_COMBOS(number), value, length))
+	{
+		return false;
+	}
+
+	if (number == active->number)
+	{
+		Keymap_Load(number);
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set how tap hold keys are decided
+///
+/// @param   term - ms held before it is a hold, KEYMAP_MIN_TAPPING_TERM to
+///                 KEYMAP_MAX_TAPPING_TERM
+/// @param   mode - KEYMAP_PERMISSIVE_HOLD | KEYMAP_HOLD_ON_OTHER, or 0
+///
+/// @return  false if either is out of range
+///////////////////////////////////////////////////////////////////////////////
+bool Keymap_SetTapping(uint32_t term, uint8_t mode)
+{
+	if ((term < KEYMAP_MIN_TAPPING_TERM) || (term > KEYMAP_MAX_TAPPING_TERM) ||
+	    (0 != (mode & ~(KEYMAP_PERMISSIVE_HOLD | KEYMAP_HOLD_ON_OTHER))))
+	{
+		return false;
+	}
+
+	tappingTerm = term;
+	tapMode     = mode;
+
+	return true;
+}
+
+void Keymap_GetTapping(uint32_t *term, uint8_t *mode)
+{
+	*term = tappingTerm;
+	*mode = tapMode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set how long after the first key of a combo the rest may follow
+///
+/// @param   term - ms, KEYMAP_MIN_COMBO_TERM to KEYMAP_MAX_COMBO_TERM
+///
+/// @return  false if out of range
+///////////////////////////////////////////////////////////////////////////////
+bool Keymap_SetComboTerm(uint32_t term)
+{
+	if ((term < KEYMAP_MIN_COMBO_TERM) || (term > KEYMAP_MAX_COMBO_TERM))
+	{
+		return false;
+	}
+
+	comboTerm = term;
+
+	return true;
+}
+
+uint32_t Keymap_GetComboTerm(void)
+{
+	return comboTerm;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set how long each key of a leader sequence may take
+///
+/// @param   timeout - ms, KEYMAP_MIN_LEADER_TIMEOUT to KEYMAP_MAX_LEADER_TIMEOUT
+///
+/// @return  false if out of range
+///////////////////////////////////////////////////////////////////////////////
+bool Keymap_SetLeaderTimeout(uint32_t timeout)
+{
+	if ((timeout < KEYMAP_MIN_LEADER_TIMEOUT) || (timeout > KEYMAP_MAX_LEADER_TIMEOUT))
+	{
+		return false;
+	}
+
+	leaderTimeout = timeout;
+
+	return true;
+}
+
+uint32_t Keymap_GetLeaderTimeout(void)
+{
+	return leaderTimeout;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, show the profile in use or switch to another
+///////////////////////////////////////////////////////////////////////////////
+int Keymap_Command(int argc, char *argv[])
+{
+	int32_t number;
+
+	if (argc > 1)
+	{
+		if (!CLI_ParseInt(argv[1], 0, KEYMAP_PROFILES - 1, &number))
+		{
+			return CLI_ERROR_ARGS;
+		}
+
+		if (!Keymap_Load((uint8_t)number))
+		{
+			Message("Profile %d has not been uploaded", number);
+			return CLI_ERROR;
+		}
+	}
+
+	Output("Profile %u, layers held %02X toggled %02X one shot %02X\r\n",
+			active->number, heldLayers, toggledLayers, oneShotLayers);
+	Output("Tapping term %u ms, permissive hold %s, hold on other key %s\r\n", tappingTerm,
+			(tapMode & KEYMAP_PERMISSIVE_HOLD) ? "on" : "off",
+			(tapMode & KEYMAP_HOLD_ON_OTHER) ? "on" : "off");
+	Output("Combo term %u ms, leader timeout %u ms\r\n", comboTerm, leaderTimeout);
+
+	for (uint8_t layer = 0; layer < KEYMAP_LAYERS; layer++)
+	{
+		Output("Layer %u\r\n", layer);
+		for (uint8_t i = 0; i < KEYMAP_INPUTS; i++)
+		{
+			if ((0 == layer) || (ACTION_NONE != active->actions[layer][i]))
+			{
+				ShowAction(inputNames[i], active->actions[layer][i]);
+			}
+		}
+	}
+
+	Output("Combos\r\n");
+	for (uint8_t n = 0; n < active->numCombos; n++)
+	{
+		char    name[NUM_KEYS * 2];
+		uint8_t length = 0;
+
+		for (uint8_t i = 0; i < NUM_KEYS; i++)
+		{
+			if (active->combos[n].keys & (1 << i))
+			{
+				if (0 != length)
+				{
+					name[length++] = '+';
+				}
+				name[length++] = "1234R"[i];
+			}
+		}
+		name[length] = '\0';
+
+		ShowAction(name, active->combos[n].action);
+	}
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// A key that is, or may become, part of a combo
+static void ComboEvent(uint8_t input, bool pressed)
+{
+	uint8_t  bit = (input < NUM_KEYS) ? (1 << input) : 0;
+	uint32_t left;
+
+	if (!pressed)
+	{
+		if (comboHeld & bit)
+		{
+			comboHeld &= ~bit;
+			if (0 == comboHeld)
+			{
+				Release(comboAction, comboInput);
+				comboAction = ACTION_NONE;
+			}
+		}
+		else if (comboKeys & bit)
+		{
+			// Let go before the term was up, it is whatever it is now
+			ComboDecide();
+			Keymap_Event(input, pressed);
+		}
+		else
+		{
+			Dispatch(input, pressed);
+		}
+		return;
+	}
+
+	if (!comboPending)
+	{
+		comboPending = true;
+		comboKeys    = 0;
+		numComboKeys = 0;
+		candidates   = active->containing[input];
+		Timer_Start(&comboTimer, comboTerm);
+	}
+	else
+	{
+		left = bit ? (candidates & active->containing[input]) : 0;
+
+		if (0 == left)
+		{
+			// Can not be part of this combo, settle it and start again
+			ComboDecide();
+			Keymap_Event(input, pressed);
+			return;
+		}
+
+		candidates = left;
+	}
+
+	comboKeys |= bit;
+	comboOrder[numComboKeys++] = input;
+
+	// Only one combo left and it is complete, no need to wait
+	if ((0 == (candidates & (candidates - 1))) &&
+	    (comboKeys == active->combos[__builtin_ctz(candidates)].keys))
+	{
+		ComboDecide();
+	}
+}
+
+// Fire the combo the held back keys make, or let them through one by one
+static void ComboDecide(void)
+{
+	uint32_t left  = candidates;
+	int8_t   match = -1;
+
+	Timer_Stop(&comboTimer);
+	comboPending = false;
+
+	while ((0 != left) && (match < 0))
+	{
+		uint8_t n = __builtin_ctz(left);
+
+		left &= left - 1;
+		if (comboKeys == active->combos[n].keys)
+		{
+			match = n;
+		}
+	}
+
+	if (match >= 0)
+	{
+		if (0 != comboHeld)
+		{
+			Release(comboAction, comboInput);
+		}
+
+		comboHeld  |= comboKeys;
+		comboAction = active->combos[match].action;
+		comboInput  = comboOrder[0];
+
+		// Macros wait for the first key pressed to come up
+		Perform(comboAction, comboInput);
+	}
+	else
+	{
+		for (uint8_t i = 0; i < numComboKeys; i++)
+		{
+			Dispatch(comboOrder[i], true);
+		}
+	}
+
+	comboKeys    = 0;
+	numComboKeys = 0;
+}
+
+// The combo term is up
+static void ComboTimeout(Timer *timer)
+{
+	if (comboPending)
+	{
+		ComboDecide();
+	}
+}
+
+// Stored as keys(1) action(2), and the combos each key is part of
+static void LoadCombos(Profile *profile, uint8_t number)
+{
+	const uint8_t *value;
+	uint16_t      length = 0;
+
+	profile->numCombos = 0;
+	memset(profile->containing, 0, sizeof(profile->containing));
+
+	value = Store_Get(STORE_KEY_COMBOS(number), &length);
+	if (NULL == value)
+	{
+		return;
+	}
+
+	for (; (length >= COMBO_BYTES) && (profile->numCombos < KEYMAP_COMBOS); length -= COMBO_BYTES)
+	{
+		Combo *combo = &profile->combos[profile->numCombos];
+
+		combo->keys   = value[0];
+		combo->action = (Action)(value[1] | (value[2] << 8));
+		value        += COMBO_BYTES;
+
+		for (uint8_t i = 0; i < NUM_KEYS; i++)
+		{
+			if (combo->keys & (1 << i))
+			{
+				profile->containing[i] |= (1UL << profile->numCombos);
+			}
+		}
+
+		profile->numCombos++;
+	}
+}
+
+// Past combo detection, on to tap hold keys
+static void Dispatch(uint8_t input, bool pressed)
+{
+	if (tapPending)
+	{
+		Interrupt(input, pressed);
+	}
+	else
+	{
+		Handle(input, pressed);
+	}
+}
+
+static void Handle(uint8_t input, bool pressed)
+{
+	if (pressed && leading)
+	{
+		// Part of the sequence, nothing to do when it comes up
+		pressedWith[input] = ACTION_BLOCK;
+		LeaderStep(input);
+	}
+	else if (pressed)
+	{
+		pressedWith[input] = Resolve(input);
+
+		if (IsTapHold(pressedWith[input]))
+		{
+			tapPending = true;
+			tapInput   = input;
+			Timer_Start(&tapTimer, tappingTerm);
+		}
+		else
+		{
+			Perform(pressedWith[input], input);
+		}
+	}
+	else
+	{
+		Release(pressedWith[input], input);
+		pressedWith[input] = ACTION_NONE;
+	}
+}
+
+// An event while the tap hold key is undecided
+static void Interrupt(uint8_t input, bool pressed)
+{
+	bool waited = false;
+
+	if (input == tapInput)
+	{
+		if (!pressed)
+		{
+			Decide(false);
+		}
+		return;
+	}
+
+	for (uint8_t i = 0; i < numWaiting; i++)
+	{
+		waited |= (input == waiting[i].input);
+	}
+
+	// Down before the tap hold key, its action is already settled
+	if (!pressed && !waited)
+	{
+		Handle(input, pressed);
+		return;
+	}
+
+	if ((pressed && (tapMode & KEYMAP_HOLD_ON_OTHER)) || (MAX_WAITING == numWaiting))
+	{
+		Decide(true);
+		Dispatch(input, pressed);
+		return;
+	}
+
+	waiting[numWaiting].input   = input;
+	waiting[numWaiting].pressed = pressed;
+	numWaiting++;
+
+	if (!pressed && (tapMode & KEYMAP_PERMISSIVE_HOLD))
+	{
+		Decide(true);
+	}
+}
+
+// Settle the tap hold key, then run what waited for it
+static void Decide(bool hold)
+{
+	KeyEvent events[MAX_WAITING];
+	uint8_t  count = numWaiting;
+	Action   action = pressedWith[tapInput];
+
+	Timer_Stop(&tapTimer);
+	memcpy(events, waiting, count * sizeof(KeyEvent));
+	numWaiting = 0;
+	tapPending = false;
+
+	if (hold)
+	{
+		Hold(action, true);
+	}
+	else
+	{
+		// Already released, the macro plays straight away
+		pressedWith[tapInput] = ACTION_NONE;
+		Perform(ACTION_MACRO(ACTION_TAP(action)), tapInput);
+	}
+
+	// These may start another tap hold key, which the rest then wait for
+	for (uint8_t i = 0; i < count; i++)
+	{
+		Dispatch(events[i].input, events[i].pressed);
+	}
+}
+
+static void LeaderStart(void)
+{
+	uint16_t length = 0;
+
+	if (leading)
+	{
+		LeaderEnd();
+	}
+
+	trie = Store_Get(STORE_KEY_LEADER(active->number), &length);
+	if ((NULL == trie) || (length < KEYMAP_NODE_BYTES))
+	{
+		return;
+	}
+
+	// Walked in place, the store must not move it from under us
+	Store_Pin(trie);
+
+	leading  = true;
+	numNodes = length / KEYMAP_NODE_BYTES;
+	node     = 0;
+	Timer_Start(&leaderTimer, leaderTimeout);
+}
+
+static void LeaderStep(uint8_t input)
+{
+	const uint8_t *at = &trie[node * KEYMAP_NODE_BYTES];
+	uint16_t      next = GetU16(&at[2 + (input * 2)]);
+	Action        action;
+	bool          leaf = true;
+
+	if ((0 == next) || (next >= numNodes))
+	{
+		// Not a sequence, it is dropped
+		LeaderEnd();
+		return;
+	}
+
+	node      = next;
+	lastInput = input;
+	at        = &trie[node * KEYMAP_NODE_BYTES];
+	action    = GetU16(at);
+
+	for (uint8_t i = 0; i < KEYMAP_INPUTS; i++)
+	{
+		leaf &= (0 == GetU16(&at[2 + (i * 2)]));
+	}
+
+	if (leaf)
+	{
+		LeaderEnd();
+
+		// The key is still down, it is released like any other
+		pressedWith[input] = action;
+		Perform(action, input);
+	}
+	else
+	{
+		Timer_Start(&leaderTimer, leaderTimeout);
+	}
+}
+
+static void LeaderEnd(void)
+{
+	Timer_Stop(&leaderTimer);
+	Store_Unpin(trie);
+	leading = false;
+}
+
+// No key in time, do what the sequence so far is bound to
+static void LeaderTimeout(Timer *timer)
+{
+	Action action;
+
+	if (!leading)
+	{
+		return;
+	}
+
+	action = GetU16(&trie[node * KEYMAP_NODE_BYTES]);
+	LeaderEnd();
+
+	// A momentary layer or turbo needs a key held down to end it, and no
+	// release comes for a key that went to the leader
+	if ((ACTION_TYPE(action) != ACTION_LAYER_MO(0)) &&
+	    (ACTION_TYPE(action) != ACTION_TURBO(0)))
+	{
+		Perform(action, lastInput);
+	}
+}
+
+// The tapping term is up with the key still down
+static void TapTimeout(Timer *timer)
+{
+	if (tapPending)
+	{
+		Decide(true);
+	}
+}
+
+static void Hold(Action action, bool down)
+{
+	uint8_t bit;
+
+	if (ACTION_TYPE(action) == ACTION_TAP_LAYER(0, 0))
+	{
+		bit = LayerBit(ACTION_HOLD(action));
+		heldLayers = down ? (heldLayers | bit) : (heldLayers & ~bit);
+	}
+	else
+	{
+		bit = 1 << (ACTION_HOLD(action) & 7);
+		modifiers = down ? (modifiers | bit) : (modifiers & ~bit);
+		USB_Keyboard_QueueReport(HID_SOURCE_KEYMAP, modifiers, NULL, 0);
+	}
+}
+
+// The action on the highest active layer that binds the input
+static Action Resolve(uint8_t input)
+{
+	uint8_t layers = heldLayers | toggledLayers | oneShotLayers | 0x01;
+	Action  action = ACTION_NONE;
+
+	for (int8_t layer = KEYMAP_LAYERS - 1; layer >= 0; layer--)
+	{
+		if (layers & (1 << layer))
+		{
+			action = active->actions[layer][input];
+			if (ACTION_NONE != action)
+			{
+				break;
+			}
+		}
+	}
+
+	// A one shot layer lasts for one key that is not a layer key
+	if ((ACTION_TYPE(action) != ACTION_LAYER_MO(0)) &&
+	    (ACTION_TYPE(action) != ACTION_LAYER_TG(0)) &&
+	    (ACTION_TYPE(action) != ACTION_LAYER_OS(0)))
+	{
+		oneShotLayers = 0;
+	}
+
+	return action;
+}
+
+static void Perform(Action action, uint8_t input)
+{
+	// Key macros play once the key is let go
+	int8_t        key = (input < NUM_KEYS) ? (int8_t)input : MACRO_NO_KEY;
+	const uint8_t *code;
+	uint16_t      length;
+	LibraryEntry  entry;
+
+	switch (ACTION_TYPE(action))
+	{
+	case ACTION_MACRO(0):
+		code = MacroSlot(ACTION_ARG(action), &length);
+		if (NULL != code)
+		{
+			Macro_Play(code, length, key);
+		}
+		break;
+
+	case ACTION_LIBRARY(0):
+		if (Library_Get(ACTION_ARG(action), &entry))
+		{
+			Macro_Play(entry.code, entry.length, key);
+		}
+		break;
+
+	case ACTION_LAYER_MO(0):
+		heldLayers |= LayerBit(ACTION_ARG(action));
+		break;
+
+	case ACTION_LAYER_TG(0):
+		toggledLayers ^= LayerBit(ACTION_ARG(action));
+		break;
+
+	case ACTION_LAYER_OS(0):
+		oneShotLayers |= LayerBit(ACTION_ARG(action));
+		break;
+
+	case ACTION_LEADER:
+		LeaderStart();
+		break;
+
+	case ACTION_PANIC:
+		USB_Keyboard_Panic();
+		break;
+
+	case ACTION_TURBO(0):
+		if (input < NUM_KEYS)
+		{
+			Turbo_Start(input, (uint8_t)ACTION_ARG(action));
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void Release(Action action, uint8_t input)
+{
+	if (ACTION_TYPE(action) == ACTION_LAYER_MO(0))
+	{
+		heldLayers &= ~LayerBit(ACTION_ARG(action));
+	}
+	else if (ACTION_TYPE(action) == ACTION_TURBO(0))
+	{
+		Turbo_Stop(input);
+	}
+	else if (IsTapHold(action))
+	{
+		// Only a hold is still in pressedWith when the key comes up
+		Hold(action, false);
+	}
+}
+
+// Stored little endian, layer 0 first, missing layers are left unbound
+static void LoadActions(Profile *profile, const uint8_t *value, uint16_t length)
+{
+	const Action *end = &profile->actions[0][0] + (KEYMAP_LAYERS * KEYMAP_INPUTS);
+	Action       *action;
+
+	memset(profile->actions, 0, sizeof(profile->actions));
+
+	for (action = &profile->actions[0][0]; (action < end) && (length >= 2); action++)
+	{
+		*action = (Action)(value[0] | (value[1] << 8));
+		value  += 2;
+		length -= 2;
+	}
+}
+
+// The macro in a slot, straight from flash
+static const uint8_t *MacroSlot(uint16_t slot, uint16_t *length)
+{
+	const uint8_t *code = NULL;
+
+	if (slot < KEYMAP_MACROS)
+	{
+		code = Store_Get(STORE_KEY_KEYMACRO(slot), length);
+	}
+
+	if ((NULL == code) && (slot < KEYMAP_INPUTS))
+	{
+		code    = (const uint8_t *)defaultMacros[slot];
+		*length = strlen(defaultMacros[slot]);
+	}
+
+	return code;
+}
+
+static void ShowAction(const char *name, Action action)
+{
+	LibraryEntry entry;
+
+	Output("  %-8s : ", name);
+
+	switch (ACTION_TYPE(action))
+	{
+	case ACTION_MACRO(0):
+		Output("macro %u\r\n", ACTION_ARG(action));
+		break;
+
+	case ACTION_LIBRARY(0):
+		if (Library_Get(ACTION_ARG(action), &entry))
+		{
+			Output("library %u \"%.*s\"\r\n", ACTION_ARG(action), entry.nameLength, entry.name);
+		}
+		else
+		{
+			Output("library %u, missing\r\n", ACTION_ARG(action));
+		}
+		break;
+
+	case ACTION_LAYER_MO(0):
+		Output("layer %u while held\r\n", ACTION_ARG(action));
+		break;
+
+	case ACTION_LAYER_TG(0):
+		Output("layer %u toggle\r\n", ACTION_ARG(action));
+		break;
+
+	case ACTION_LAYER_OS(0):
+		Output("layer %u one shot\r\n", ACTION_ARG(action));
+		break;
+
+	case ACTION_TAP_LAYER(0, 0):
+		Output("tap macro %u, hold layer %u\r\n", ACTION_TAP(action), ACTION_HOLD(action));
+		break;
+
+	case ACTION_TAP_MOD(0, 0):
+		Output("tap macro %u, hold modifier %02X\r\n", ACTION_TAP(action), 1 << (ACTION_HOLD(action) & 7));
+		break;
+
+	case ACTION_LEADER:
+		Output("leader\r\n");
+		break;
+
+	case ACTION_PANIC:
+		Output("panic\r\n");
+		break;
+
+	case ACTION_TURBO(0):
+		Output("turbo usage %02X\r\n", (uint8_t)ACTION_ARG(action));
+		break;
+
+	case ACTION_BLOCK:
+		Output("blocked\r\n");
+		break;
+
+	default:
+		Output("none\r\n");
+		break;
+	}
+}
@@ -0,0 +1,522 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Library.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Library of named macros, kept in the flash store
+///
+///             Each macro has an ID and is stored under STORE_KEY_LIBRARY(id)
+///             as :
+///
+///                 nameLength(1) name(nameLength) byte code
+///
+///             so finding one by ID is a store lookup. To find one by name
+///             an array of IDs is kept in RAM, sorted by name like cmds[] in
+///             CLI.c, and binary searched. It is rebuilt from the store at
+///             power up, the same way the store rebuilds its own index from
+///             the log, so there is nothing extra to keep in step in flash.
+///
+///             Macro uploads from the host, for a key or the library, are
+///             put together here and saved once they stop arriving.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Library.h"
+#include "CLI.h"
+#include "Macro.h"
+#include "Store.h"
+#include "Timer.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define SAVE_DELAY_MS	1000		// Quiet time after an upload before saving it
+#define NO_UPLOAD		0xFFFF
+#define TEXT_MAX		100			// Longest text the macro command takes, a CLI line
+
+#define IS_LIBRARY_KEY(k)	(((k) >= STORE_KEY_LIBRARY(0)) && ((k) < STORE_KEY_LIBRARY(LIBRARY_SIZE)))
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static bool     Parse(const uint8_t *value, uint16_t length, LibraryEntry *entry);
+static bool     ValidName(const char *name, uint8_t length);
+static int      CompareName(const char *name, uint8_t length, uint16_t id);
+static int      CompareIds(const void *a, const void *b);
+static uint32_t Position(const char *name, uint8_t length, bool *found);
+static void     RemoveId(uint16_t id);
+static void     SaveUpload(Timer *timer);
+static bool     ListProducer(uint32_t step);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// IDs of every library macro, in name order
+static uint16_t		sorted[LIBRARY_SIZE];
+static uint32_t		count = 0;
+
+static uint32_t		listPage = 0;			// For ListProducer()
+
+// Uploads are put together here, then saved to the flash store
+static Timer		saveTimer;
+static uint8_t		upload[MACRO_UPLOAD_SIZE];
+static uint16_t		uploadLength = 0;
+static uint16_t		uploadKey = NO_UPLOAD;	// Store key the upload is for
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Build the name index, call after Store_Init()
+///////////////////////////////////////////////////////////////////////////////
+void Library_Init(void)
+{
+	LibraryEntry entry;
+
+	count = 0;
+	for (uint16_t id = 0; id < LIBRARY_SIZE; id++)
+	{
+		if (Library_Get(id, &entry))
+		{
+			sorted[count++] = id;
+		}
+	}
+
+	qsort(sorted, count, sizeof(sorted[0]), CompareIds);
+
+	Timer_Init(&saveTimer, SaveUpload, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Look up a macro by name
+///
+/// @return  Its ID, or LIBRARY_NONE
+///////////////////////////////////////////////////////////////////////////////
+int32_t Library_Find(const char *name)
+{
+	size_t   length = strlen(name);
+	bool     found;
+	uint32_t position;
+
+	if ((0 == length) || (length > LIBRARY_NAME_MAX))
+	{
+		return LIBRARY_NONE;
+	}
+
+	position = Position(name, (uint8_t)length, &found);
+
+	return found ? sorted[position] : LIBRARY_NONE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Look up a macro by ID
+///
+/// @param   id    - 0 to LIBRARY_SIZE - 1
+/// @param   entry - Receives pointers into the store, see Store_Get()
+///
+/// @return  false if there is no such macro
+///////////////////////////////////////////////////////////////////////////////
+bool Library_Get(uint16_t id, LibraryEntry *entry)
+{
+	const uint8_t *value;
+	uint16_t      length;
+
+	if (id >= LIBRARY_SIZE)
+	{
+		return false;
+	}
+
+	value = Store_Get(STORE_KEY_LIBRARY(id), &length);
+
+	return (NULL != value) && Parse(value, length, entry);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Add or replace a macro
+///
+/// @param   id     - 0 to LIBRARY_SIZE - 1
+/// @param   value  - nameLength(1) name byte code, as stored
+/// @param   length - Size of value
+///
+/// @return  false if the value is bad, the name belongs to another macro or
+///          the store is full
+///////////////////////////////////////////////////////////////////////////////
+bool Library_Put(uint16_t id, const uint8_t *value, uint16_t length)
+{
+	LibraryEntry entry;
+	bool         found;
+	uint32_t     position;
+
+	if ((id >= LIBRARY_SIZE) || !Parse(value, length, &entry))
+	{
+		return false;
+	}
+
+	position = Position(entry.name, entry.nameLength, &found);
+	if (found && (id != sorted[position]))
+	{
+		return false;
+	}
+
+	if (!Store_Put(STORE_KEY_LIBRARY(id), value, length))
+	{
+		return false;
+	}
+
+	// It may have been renamed, so find its place again
+	RemoveId(id);
+	position = Position(entry.name, entry.nameLength, &found);
+	memmove(&sorted[position + 1], &sorted[position], (count - position) * sizeof(sorted[0]));
+	sorted[position] = id;
+	count++;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Remove a macro, harmless if there is none
+///////////////////////////////////////////////////////////////////////////////
+bool Library_Delete(uint16_t id)
+{
+	if ((id >= LIBRARY_SIZE) || !Store_Delete(STORE_KEY_LIBRARY(id)))
+	{
+		return false;
+	}
+
+	RemoveId(id);
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Start playing a macro from the library
+///
+/// @return  false if there is no such macro or no free player
+///////////////////////////////////////////////////////////////////////////////
+bool Library_Play(uint16_t id)
+{
+	LibraryEntry entry;
+
+	return Library_Get(id, &entry) && Macro_Play(entry.code, entry.length, MACRO_NO_KEY);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Receive part of a macro or leader trie upload
+///
+/// @param   storeKey - STORE_KEY_KEYMACRO(), STORE_KEY_LIBRARY() or
+///                     STORE_KEY_LEADER()
+/// @param   offset   - Where to write, 0 starts a new upload
+/// @param   data     - Bytes of the value, as it is to be stored
+/// @param   length   - Number of bytes in data
+///
+/// @return  false if the upload would not fit, or the piece belongs to an
+///          upload that has not been started
+///////////////////////////////////////////////////////////////////////////////
+bool Library_Upload(uint16_t storeKey, uint16_t offset, const uint8_t *data, uint16_t length)
+{
+	if ((offset + length) > MACRO_UPLOAD_SIZE)
+	{
+		return false;
+	}
+
+	if (0 == offset)
+	{
+		// Starting another one, finish off the last one first
+		if ((NO_UPLOAD != uploadKey) && (uploadKey != storeKey))
+		{
+			SaveUpload(&saveTimer);
+		}
+
+		uploadKey    = storeKey;
+		uploadLength = 0;
+	}
+	else if (uploadKey != storeKey)
+	{
+		return false;
+	}
+
+	memcpy(&upload[offset], data, length);
+	if ((offset + length) > uploadLength)
+	{
+		uploadLength = offset + length;
+	}
+
+	// Uploads come in pieces, save once they stop
+	Timer_Start(&saveTimer, SAVE_DELAY_MS);
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, define or delete a library macro
+///////////////////////////////////////////////////////////////////////////////
+int Library_MacroCommand(int argc, char *argv[])
+{
+	int32_t id;
+	uint8_t value[1 + LIBRARY_NAME_MAX + TEXT_MAX];
+	size_t  nameLength;
+	size_t  textLength;
+
+	if ((3 == argc) || !CLI_ParseInt(argv[1], 0, LIBRARY_SIZE - 1, &id))
+	{
+		return CLI_ERROR_ARGS;
+	}
+
+	if (2 == argc)
+	{
+		Library_Delete((uint16_t)id);
+		Message("Macro %d deleted", id);
+		return CLI_OK;
+	}
+
+	nameLength = strlen(argv[2]);
+	textLength = strlen(argv[3]);
+	if ((0 == nameLength) || (nameLength > LIBRARY_NAME_MAX) || (textLength > TEXT_MAX))
+	{
+		return CLI_ERROR_ARGS;
+	}
+
+	// Plain text is a valid macro
+	value[0] = (uint8_t)nameLength;
+	memcpy(&value[1], argv[2], nameLength);
+	memcpy(&value[1 + nameLength], argv[3], textLength);
+
+	if (!Library_Put((uint16_t)id, value, (uint16_t)(1 + nameLength + textLength)))
+	{
+		Message("Could not save macro %d, name in use or store full", id);
+		return CLI_ERROR;
+	}
+
+	Message("Macro %d saved as \"%s\"", id, argv[2]);
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, list a page of the library in name order
+///////////////////////////////////////////////////////////////////////////////
+int Library_ListCommand(int argc, char *argv[])
+{
+	int32_t page  = 1;
+	int32_t pages = (count + LIBRARY_PAGE - 1) / LIBRARY_PAGE;
+
+	if ((argc > 1) && !CLI_ParseInt(argv[1], 1, (pages > 0) ? pages : 1, &page))
+	{
+		return CLI_ERROR_ARGS;
+	}
+
+	listPage = page - 1;
+	if (!CLI_StartProducer(ListProducer))
+	{
+		Message("Output busy, try again");
+		return CLI_ERROR;
+	}
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, play a library macro by name, or by ID
+///////////////////////////////////////////////////////////////////////////////
+int Library_PlayCommand(int argc, char *argv[])
+{
+	int32_t id = Library_Find(argv[1]);
+
+	if ((LIBRARY_NONE == id) && !CLI_ParseInt(argv[1], 0, LIBRARY_SIZE - 1, &id))
+	{
+		Message("No macro called \"%s\"", argv[1]);
+		return CLI_ERROR;
+	}
+
+	if (!Library_Play((uint16_t)id))
+	{
+		Message("Could not play macro \"%s\"", argv[1]);
+		return CLI_ERROR;
+	}
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Split a stored value into name and byte code
+static bool Parse(const uint8_t *value, uint16_t length, LibraryEntry *entry)
+{
+	if ((length < 1) || ((1UL + value[0]) > length) ||
+	    !ValidName((const char *)&value[1], value[0]))
+	{
+		return false;
+	}
+
+	entry->name       = (const char *)&value[1];
+	entry->nameLength = value[0];
+	entry->code       = &value[1 + value[0]];
+	entry->length     = length - 1 - value[0];
+
+	return true;
+}
+
+// Something that can be typed as one CLI argument
+static bool ValidName(const char *name, uint8_t length)
+{
+	if ((0 == length) || (length > LIBRARY_NAME_MAX))
+	{
+		return false;
+	}
+
+	for (uint8_t i = 0; i < length; i++)
+	{
+		if ((name[i] <= ' ') || (name[i] > '~') || ('"' == name[i]))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// strcmp() order of a name against the name of a stored macro
+static int CompareName(const char *name, uint8_t length, uint16_t id)
+{
+	LibraryEntry entry;
+	int          result;
+
+	if (!Library_Get(id, &entry))
+	{
+		return -1;
+	}
+
+	result = memcmp(name, entry.name, (length < entry.nameLength) ? length : entry.nameLength);
+	if (0 == result)
+	{
+		result = (int)length - (int)entry.nameLength;
+	}
+
+	return result;
+}
+
+// qsort() callback
+static int CompareIds(const void *a, const void *b)
+{
+	LibraryEntry entry;
+
+	Library_Get(*(const uint16_t *)a, &entry);
+
+	return CompareName(entry.name, entry.nameLength, *(const uint16_t *)b);
+}
+
+// Binary search of sorted[], where the name is or would go
+static uint32_t Position(const char *name, uint8_t length, bool *found)
+{
+	uint32_t low  = 0;
+	uint32_t high = count;
+
+	*found = false;
+
+	while (low < high)
+	{
+		uint32_t mid    = (low + high) / 2;
+		int      result = CompareName(name, length, sorted[mid]);
+
+		if (0 == result)
+		{
+			*found = true;
+			return mid;
+		}
+		else if (result < 0)
+		{
+			high = mid;
+		}
+		else
+		{
+			low = mid + 1;
+		}
+	}
+
+	return low;
+}
+
+static void RemoveId(uint16_t id)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (id == sorted[i])
+		{
+			count--;
+			memmove(&sorted[i], &sorted[i + 1], (count - i) * sizeof(sorted[0]));
+			break;
+		}
+	}
+}
+
+// Save the upload to the flash store
+static void SaveUpload(Timer *timer)
+{
+	bool saved;
+
+	Timer_Stop(&saveTimer);
+
+	if (NO_UPLOAD == uploadKey)
+	{
+		return;
+	}
+
+	if (IS_LIBRARY_KEY(uploadKey))
+	{
+		LibraryEntry entry;
+
+		// Retrying will not fix a bad one
+		if (!Parse(upload, uploadLength, &entry))
+		{
+			Message("Bad library macro %u dropped", uploadKey - STORE_KEY_LIBRARY(0));
+			uploadKey = NO_UPLOAD;
+			return;
+		}
+
+		saved = Library_Put(uploadKey - STORE_KEY_LIBRARY(0), upload, uploadLength);
+	}
+	else
+	{
+		saved = Store_Put(uploadKey, upload, uploadLength);
+	}
+
+	if (saved)
+	{
+		uploadKey = NO_UPLOAD;
+	}
+	else
+	{
+		Message("Could not save the macro upload, retrying");
+		Timer_Start(&saveTimer, SAVE_DELAY_MS);
+	}
+}
+
+// Output for Library_ListCommand(), one macro per step
+static bool ListProducer(uint32_t step)
+{
+	uint32_t     first = listPage * LIBRARY_PAGE;
+	uint32_t     last  = ((first + LIBRARY_PAGE) < count) ? (first + LIBRARY_PAGE) : count;
+	LibraryEntry entry;
+
+	if (0 == step)
+	{
+		Output("Macros %u to %u of %u :\r\n", (last > first) ? first + 1 : 0, last, count);
+	}
+	else if (Library_Get(sorted[first + step - 1], &entry))
+	{
+		Output("%5u  %-*.*s  %u bytes\r\n", sorted[first + step - 1],
+		       LIBRARY_NAME_MAX, entry.nameLength, entry.name, entry.length);
+	}
+
+	return ((first + step) >= last);
+}
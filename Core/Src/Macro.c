@@ -0,0 +1,700 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Macro.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Macro playback
+///
+///             Each playing macro has a player, a coroutine that waits for
+///             its key to be released, then runs the macro's byte code one
+///             instruction at a time, waiting for room in the HID report
+///             queue or for a delay instead of blocking. Macro_Update() runs
+///             every player that may be able to continue, on EVENT_MACRO, so
+///             several macros make progress together.
+///
+///             Each player is its own HID source. What it holds down is
+///             merged with the other sources into every report, so one macro
+///             can hold Ctrl while another taps keys, and stopping one lets
+///             go of only its keys.
+///
+///             See Macro.h for the byte code.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+#include <string.h>
+
+#include "Macro.h"
+#include "Coroutine.h"
+#include "Scheduler.h"
+#include "CLI.h"
+#include "Store.h"
+#include "usb_hid_keyboard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define MAX_HELD			6		// Keys in one report
+#define STEP_REPORTS		2		// Most reports one instruction queues
+#define STEP_BUDGET			32		// Instructions per run before letting others in
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef enum
+{
+	STEP_NEXT,			// Carry on
+	STEP_DELAY,			// Wait player->delay ms
+	STEP_END,			// OP_END reached
+	STEP_ERROR,			// Bad byte code
+} StepResult;
+
+typedef struct
+{
+	uint16_t	start;		// First instruction of the loop body
+	uint16_t	remaining;	// Times still to run it
+} Loop;
+
+// OP_PACKED decoder
+typedef struct
+{
+	uint16_t	end;				// pc after the compressed data
+	uint8_t		flags;				// Of the current group
+	uint8_t		flagBits;			// Left in flags
+	uint16_t	copyLeft;			// Characters still to copy
+	uint8_t		distance;			// Back from pos, 0 means MACRO_WINDOW
+	uint8_t		pos;				// Next free place in window, wraps
+	uint16_t	filled;				// Characters in window, up to MACRO_WINDOW
+	uint8_t		window[MACRO_WINDOW];
+} Unpacker;
+
+typedef struct
+{
+	CoLine			line;
+	bool			active;
+	bool			cancelled;	// Let go of everything and stop
+	int8_t			key;		// Wait for this key to be released, or MACRO_NO_KEY
+	Timer			timer;		// For CR_DELAY()
+
+	// Interpreter state
+	const uint8_t	*code;
+	uint16_t		length;
+	uint16_t		pc;
+	uint16_t		steps;		// Since the last yield
+	uint8_t			typing;		// OP_TYPE characters left
+	bool			unpacking;	// In OP_PACKED
+	Unpacker		packed;
+	uint32_t		delay;
+	Loop			loops[MACRO_MAX_LOOPS];
+	uint8_t			depth;
+
+	// What the player is holding down
+	uint8_t			modifiers;
+	uint8_t			held[MAX_HELD];
+	uint8_t			numHeld;
+} Player;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static int        Play(Player *player);
+static StepResult Step(Player *player);
+static bool       Fetch(Player *player, uint8_t *value);
+static bool       FetchVarint(Player *player, uint32_t *value);
+static int        Unpack(Player *player, uint8_t *ch);
+static void       Remember(Unpacker *packed, uint8_t ch);
+static void       TypeChar(Player *player, char ch);
+static void       Press(Player *player, uint8_t usage);
+static void       Release(Player *player, uint8_t usage);
+static void       SendState(Player *player, uint8_t modifiers, uint8_t usage);
+static void       PlayerWake(Timer *timer);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static Player players[MACRO_MAX_PLAYERS];
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+void Macro_Init(void)
+{
+	for (uint32_t i = 0; i < MACRO_MAX_PLAYERS; i++)
+	{
+		players[i].active = false;
+		Timer_Init(&players[i].timer, PlayerWake, &players[i]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Start playing a macro
+///
+/// @param   code   - Byte code, played in place so it must stay valid. Flash
+///                   store values are pinned until the macro finishes.
+/// @param   length - Size of code, playing stops at the end or OP_END
+/// @param   key    - Key to wait for the release of first, or MACRO_NO_KEY
+///
+/// @return  false if every player is busy
+///////////////////////////////////////////////////////////////////////////////
+bool Macro_Play(const uint8_t *code, uint16_t length, int8_t key)
+{
+	for (uint32_t i = 0; i < MACRO_MAX_PLAYERS; i++)
+	{
+		Player *player = &players[i];
+
+		if (!player->active)
+		{
+			player->line      = 0;
+			player->cancelled = false;
+			player->key       = key;
+			player->code      = code;
+			player->length    = length;
+			player->pc        = 0;
+			player->steps     = 0;
+			player->typing    = 0;
+			player->unpacking = false;
+			player->depth     = 0;
+			player->modifiers = 0;
+			player->numHeld   = 0;
+			player->active    = true;
+
+			// Played in place, the store must not erase it from under us
+			Store_Pin(code);
+
+			Scheduler_Signal(EVENT_MACRO);
+			return true;
+		}
+	}
+
+	Message("Macro dropped, %u already playing", MACRO_MAX_PLAYERS);
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Stop a macro, releasing the keys it holds and no others
+///
+/// @param   player - 0 to MACRO_MAX_PLAYERS - 1
+///////////////////////////////////////////////////////////////////////////////
+void Macro_Cancel(uint8_t player)
+{
+	if ((player < MACRO_MAX_PLAYERS) && players[player].active)
+	{
+		// Wakes it from a delay, it finishes on its next run
+		players[player].cancelled = true;
+		Timer_Stop(&players[player].timer);
+		Scheduler_Signal(EVENT_MACRO);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Stop every macro at once, without letting go of their keys. For
+///          USB_Keyboard_Panic(), which clears every source's keys itself.
+///
+/// @return  How many were playing
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Macro_Abort(void)
+{
+	uint8_t stopped = 0;
+
+	for (uint32_t i = 0; i < MACRO_MAX_PLAYERS; i++)
+	{
+		Player *player = &players[i];
+
+		if (player->active)
+		{
+			Timer_Stop(&player->timer);
+			player->active = false;
+			Store_Unpin(player->code);
+			stopped++;
+		}
+	}
+
+	return stopped;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Let every playing macro continue, scheduler task
+///////////////////////////////////////////////////////////////////////////////
+void Macro_Update(void)
+{
+	for (uint32_t i = 0; i < MACRO_MAX_PLAYERS; i++)
+	{
+		Player *player = &players[i];
+
+		if (player->active && (CR_DONE == Play(player)))
+		{
+			player->active = false;
+			Store_Unpin(player->code);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, show what each player is doing, or stop them
+///////////////////////////////////////////////////////////////////////////////
+int Macro_Command(int argc, char *argv[])
+{
+	int32_t number;
+
+	if ((argc > 1) && (0 == strcmp(argv[1], "all")))
+	{
+		for (uint8_t i = 0; i < MACRO_MAX_PLAYERS; i++)
+		{
+			Macro_Cancel(i);
+		}
+		return CLI_OK;
+	}
+
+	if (argc > 1)
+	{
+		if (!CLI_ParseInt(argv[1], 0, MACRO_MAX_PLAYERS - 1, &number))
+		{
+			return CLI_ERROR_ARGS;
+		}
+
+		Macro_Cancel((uint8_t)number);
+		return CLI_OK;
+	}
+
+	for (uint8_t i = 0; i < MACRO_MAX_PLAYERS; i++)
+	{
+		Player *player = &players[i];
+
+		if (player->active)
+		{
+			Output("%u : at %u of %u, modifiers %02X, %u keys held\r\n",
+					i, player->pc, player->length, player->modifiers, player->numHeld);
+		}
+		else
+		{
+			Output("%u : idle\r\n", i);
+		}
+	}
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// The player coroutine
+static int Play(Player *player)
+{
+	StepResult result = STEP_NEXT;
+
+	CR_BEGIN(&player->line);
+
+	if (MACRO_NO_KEY != player->key)
+	{
+		CR_WAIT_UNTIL(&player->line, player->cancelled || !USB_IsKeyPressed(player->key));
+	}
+
+	for (;;)
+	{
+		CR_WAIT_UNTIL(&player->line, USB_Keyboard_QueueSpace() >= STEP_REPORTS);
+
+		if (player->cancelled)
+		{
+			break;
+		}
+
+		result = Step(player);
+
+		if (STEP_DELAY == result)
+		{
+			CR_DELAY(&player->line, &player->timer, player->delay);
+		}
+		else if (STEP_NEXT != result)
+		{
+			break;
+		}
+
+		// Jumps can loop forever without output, give the others a go
+		if (++player->steps >= STEP_BUDGET)
+		{
+			player->steps = 0;
+			Scheduler_Signal(EVENT_MACRO);
+			CR_YIELD(&player->line);
+		}
+	}
+
+	if (STEP_ERROR == result)
+	{
+		Message("Bad macro instruction at %u", player->pc);
+	}
+
+	// Never leave keys stuck down
+	if ((0 != player->modifiers) || (0 != player->numHeld))
+	{
+		player->modifiers = 0;
+		player->numHeld   = 0;
+
+		CR_WAIT_UNTIL(&player->line, USB_Keyboard_QueueSpace() >= 1);
+		SendState(player, 0, 0);
+	}
+
+	CR_END(&player->line);
+}
+
+// Run one instruction, queuing no more than STEP_REPORTS reports
+static StepResult Step(Player *player)
+{
+	uint8_t    op;
+	uint8_t    value;
+	StepResult result = STEP_NEXT;
+
+	// Part way through an OP_TYPE string
+	if (player->typing > 0)
+	{
+		if (!Fetch(player, &value))
+		{
+			return STEP_ERROR;
+		}
+
+		player->typing--;
+		TypeChar(player, (char)value);
+		return STEP_NEXT;
+	}
+
+	// Part way through an OP_PACKED block
+	if (player->unpacking)
+	{
+		int got = Unpack(player, &value);
+
+		if (got < 0)
+		{
+			return STEP_ERROR;
+		}
+		if (got > 0)
+		{
+			TypeChar(player, (char)value);
+			return STEP_NEXT;
+		}
+
+		player->unpacking = false;
+	}
+
+	if (!Fetch(player, &op))
+	{
+		// Running off the end is the same as OP_END
+		return STEP_END;
+	}
+
+	// No key for '\r', it is dropped
+	if (((op >= 0x20) && (op <= 0x7E)) || ('\t' == op) || ('\n' == op) || ('\r' == op))
+	{
+		TypeChar(player, (char)op);
+		return STEP_NEXT;
+	}
+
+	switch (op)
+	{
+		case OP_END:
+			result = STEP_END;
+			break;
+
+		case OP_PRESS:
+		case OP_RELEASE:
+		case OP_TAP:
+		case OP_MOD_DOWN:
+		case OP_MOD_UP:
+			if (!Fetch(player, &value))
+			{
+				result = STEP_ERROR;
+			}
+			else if (OP_PRESS == op)
+			{
+				Press(player, value);
+			}
+			else if (OP_RELEASE == op)
+			{
+				Release(player, value);
+			}
+			else if (OP_TAP == op)
+			{
+				Press(player, value);
+				Release(player, value);
+			}
+			else if (OP_MOD_DOWN == op)
+			{
+				player->modifiers |= value;
+				SendState(player, 0, 0);
+			}
+			else
+			{
+				player->modifiers &= (uint8_t)~value;
+				SendState(player, 0, 0);
+			}
+			break;
+
+		case OP_TYPE:
+			if (!Fetch(player, &player->typing))
+			{
+				result = STEP_ERROR;
+			}
+			break;
+
+		case OP_DELAY:
+			result = FetchVarint(player, &player->delay) ? STEP_DELAY : STEP_ERROR;
+			break;
+
+		case OP_REPEAT:
+			// A count of 0 would still run the body once
+			if (!Fetch(player, &value) || (0 == value) || (player->depth >= MACRO_MAX_LOOPS))
+			{
+				result = STEP_ERROR;
+			}
+			else
+			{
+				player->loops[player->depth].start     = player->pc;
+				player->loops[player->depth].remaining = value;
+				player->depth++;
+			}
+			break;
+
+		case OP_NEXT:
+			if (0 == player->depth)
+			{
+				result = STEP_ERROR;
+			}
+			else
+			{
+				Loop *loop = &player->loops[player->depth - 1];
+
+				if (loop->remaining > 1)
+				{
+					loop->remaining--;
+					player->pc = loop->start;
+				}
+				else
+				{
+					player->depth--;
+				}
+			}
+			break;
+
+		case OP_PACKED:
+		{
+			uint32_t size;
+
+			if (!FetchVarint(player, &size) || ((player->pc + size) > player->length))
+			{
+				result = STEP_ERROR;
+				break;
+			}
+
+			memset(&player->packed, 0, sizeof(player->packed));
+			player->packed.end = (uint16_t)(player->pc + size);
+			player->unpacking  = true;
+			break;
+		}
+
+		case OP_JUMP:
+		{
+			uint8_t low;
+			uint8_t high;
+			int32_t target;
+
+			if (!Fetch(player, &low) || !Fetch(player, &high))
+			{
+				result = STEP_ERROR;
+				break;
+			}
+
+			target = (int32_t)player->pc + (int16_t)(low | (high << 8));
+			if ((target < 0) || (target >= player->length))
+			{
+				result = STEP_ERROR;
+			}
+			else
+			{
+				player->pc = (uint16_t)target;
+			}
+			break;
+		}
+
+		default:
+			result = STEP_ERROR;
+			break;
+	}
+
+	return result;
+}
+
+static bool Fetch(Player *player, uint8_t *value)
+{
+	if (player->pc >= player->length)
+	{
+		return false;
+	}
+
+	*value = player->code[player->pc++];
+	return true;
+}
+
+static bool FetchVarint(Player *player, uint32_t *value)
+{
+	uint8_t byte;
+	uint8_t shift = 0;
+
+	*value = 0;
+
+	do
+	{
+		if ((shift > 28) || !Fetch(player, &byte))
+		{
+			return false;
+		}
+
+		*value |= (uint32_t)(byte & 0x7F) << shift;
+		shift  += 7;
+	} while (byte & 0x80);
+
+	return true;
+}
+
+// Next character of an OP_PACKED block
+//
+// Returns 1 with the character, 0 at the end of the block or -1 if the data
+// is bad
+static int Unpack(Player *player, uint8_t *ch)
+{
+	Unpacker *packed = &player->packed;
+	uint8_t  value;
+
+	if (0 == packed->copyLeft)
+	{
+		if (player->pc >= packed->end)
+		{
+			return 0;
+		}
+
+		if (0 == packed->flagBits)
+		{
+			Fetch(player, &packed->flags);
+			packed->flagBits = 8;
+
+			// A group can end with unused flags
+			if (player->pc >= packed->end)
+			{
+				return 0;
+			}
+		}
+
+		packed->flagBits--;
+		if (packed->flags & 1)
+		{
+			packed->flags >>= 1;
+			Fetch(player, &value);
+			Remember(packed, value);
+			*ch = value;
+			return 1;
+		}
+
+		packed->flags >>= 1;
+		if ((player->pc + 2) > packed->end)
+		{
+			return -1;
+		}
+
+		// Nothing typed that far back yet
+		Fetch(player, &value);
+		if ((value + 1) > packed->filled)
+		{
+			return -1;
+		}
+
+		packed->distance = value + 1;
+		Fetch(player, &value);
+		packed->copyLeft = value + 3;
+	}
+
+	// distance wraps to 0 for a whole window, the same as MACRO_WINDOW
+	value = packed->window[(uint8_t)(packed->pos - packed->distance)];
+	Remember(packed, value);
+	packed->copyLeft--;
+	*ch = value;
+
+	return 1;
+}
+
+// Add a character to the OP_PACKED history
+static void Remember(Unpacker *packed, uint8_t ch)
+{
+	packed->window[packed->pos++] = ch;
+	if (packed->filled < MACRO_WINDOW)
+	{
+		packed->filled++;
+	}
+}
+
+// Tap the keys for one character, on top of anything the macro is holding
+static void TypeChar(Player *player, char ch)
+{
+	uint8_t modifier;
+	uint8_t usage;
+
+	if (USB_Keyboard_AsciiToHid(ch, &modifier, &usage))
+	{
+		SendState(player, modifier, usage);
+		SendState(player, 0, 0);
+	}
+}
+
+static void Press(Player *player, uint8_t usage)
+{
+	for (uint8_t i = 0; i < player->numHeld; i++)
+	{
+		if (usage == player->held[i])
+		{
+			return;
+		}
+	}
+
+	if (player->numHeld < MAX_HELD)
+	{
+		player->held[player->numHeld++] = usage;
+	}
+
+	SendState(player, 0, 0);
+}
+
+static void Release(Player *player, uint8_t usage)
+{
+	for (uint8_t i = 0; i < player->numHeld; i++)
+	{
+		if (usage == player->held[i])
+		{
+			player->numHeld--;
+			memmove(&player->held[i], &player->held[i + 1], player->numHeld - i);
+			break;
+		}
+	}
+
+	SendState(player, 0, 0);
+}
+
+// Queue a report of what the player holds, plus one extra key if usage != 0
+static void SendState(Player *player, uint8_t modifiers, uint8_t usage)
+{
+	uint8_t keys[MAX_HELD];
+	uint8_t count = player->numHeld;
+
+	memcpy(keys, player->held, count);
+	if ((0 != usage) && (count < MAX_HELD))
+	{
+		keys[count++] = usage;
+	}
+
+	USB_Keyboard_QueueReport(HID_SOURCE_MACRO(player - players), player->modifiers | modifiers, keys, count);
+}
+
+// A player's delay is over
+static void PlayerWake(Timer *timer)
+{
+	Scheduler_Signal(EVENT_MACRO);
+}
@@ -0,0 +1,721 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Protocol.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Binary host protocol, see Protocol.h for the frame format
+///
+///             The CLI never sends or expects 0x00, so a 0x00 from the host
+///             switches the receiver into frame mode until the closing 0x00.
+///             A frame that stalls part way through falls back to text mode.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <string.h>
+
+#include "stm32f4xx_hal.h"
+
+#include "Protocol.h"
+#include "Cobs.h"
+#include "Crc16.h"
+#include "CLI.h"
+#include "screen.h"
+#include "usb_hid_keyboard.h"
+#include "Store.h"
+#include "Keymap.h"
+#include "Library.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define HEADER_SIZE			3		// type, seq, ack
+#define CRC_SIZE			2
+#define MAX_BODY			(HEADER_SIZE + PROTOCOL_MAX_PAYLOAD + CRC_SIZE)
+#define MAX_ENCODED			COBS_MAX_ENCODED(MAX_BODY)
+
+#define FRAME_DELIMITER		0x00
+#define FRAME_TIMEOUT		100		// ms between bytes before a frame is abandoned
+
+#define MAX_TELEMETRY_MS	60000
+#define NUM_CONFIG			9			// CONFIG_xxx keys
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Sent frame kept until the host acknowledges it
+typedef struct
+{
+	uint8_t	type;
+	uint8_t	length;
+	uint8_t	payload[PROTOCOL_MAX_PAYLOAD];
+} WindowEntry;
+
+typedef struct
+{
+	uint32_t	framesRx;
+	uint32_t	framesTx;
+	uint32_t	badFrames;		// COBS, length or CRC errors
+	uint32_t	outOfOrder;
+	uint32_t	retransmits;
+	uint32_t	windowFull;		// Sends refused for lack of window space
+} ProtocolStats;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static void SendFrame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t length);
+static void ProcessFrame(uint8_t *body, uint32_t length);
+static void ProcessAck(uint8_t ack);
+static void HandleMessage(uint8_t type, const uint8_t *payload, uint8_t length);
+static void SendError(uint8_t type, uint8_t reason);
+static void SendConfigValue(uint8_t key);
+static bool WriteConfig(uint8_t key, uint32_t value);
+static void SendTelemetry(void);
+static void PutU16(uint8_t *dst, uint16_t value);
+static void PutU32(uint8_t *dst, uint32_t value);
+static uint16_t GetU16(const uint8_t *src);
+static uint32_t GetU32(const uint8_t *src);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Receive side
+static bool		inFrame = false;
+static uint8_t	rxFrame[MAX_ENCODED];
+static uint32_t	rxLength = 0;
+static bool		rxOverflow = false;		// Frame too long, drop it
+static uint32_t	rxLastByte = 0;
+static uint8_t	rxExpected = 0;			// Next seq wanted from the host
+
+// Transmit side
+static WindowEntry	window[PROTOCOL_WINDOW];
+static uint8_t		txBase = 0;			// Oldest unacknowledged seq
+static uint8_t		txNext = 0;			// seq for the next reliable frame
+static uint32_t		txLastSend = 0;
+static bool			ackSent = false;	// A frame carrying the latest ack went out
+
+static uint32_t		telemetryPeriod = 0;
+static uint32_t		telemetryLast = 0;
+
+static ProtocolStats stats = {0};
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Offer a received byte to the protocol
+///
+/// @param   data - Byte from USART2
+///
+/// @return  true  - byte belongs to a frame
+///          false - byte is for the text CLI
+///////////////////////////////////////////////////////////////////////////////
+bool Protocol_ProcessByte(uint8_t data)
+{
+	bool consumed = true;
+
+	if (!inFrame)
+	{
+		if (FRAME_DELIMITER == data)
+		{
+			inFrame    = true;
+			rxLength   = 0;
+			rxOverflow = false;
+		}
+		else
+		{
+			consumed = false;
+		}
+	}
+	else if (FRAME_DELIMITER == data)
+	{
+		// Back to back delimiters just restart the frame
+		if (rxOverflow)
+		{
+			inFrame = false;
+		}
+		else if (rxLength > 0)
+		{
+			int32_t length = Cobs_Decode(rxFrame, rxLength, rxFrame);
+
+			if (length < 0)
+			{
+				stats.badFrames++;
+			}
+			else
+			{
+				ProcessFrame(rxFrame, (uint32_t)length);
+			}
+
+			inFrame = false;
+		}
+	}
+	else if (rxLength < sizeof(rxFrame))
+	{
+		rxFrame[rxLength++] = data;
+	}
+	else if (!rxOverflow)
+	{
+		// Too long, wait for the closing delimiter and drop it
+		stats.badFrames++;
+		rxOverflow = true;
+	}
+
+	rxLastByte = HAL_GetTick();
+
+	return consumed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Retransmit, time out partial frames and stream telemetry.
+///          Called by Main()
+///////////////////////////////////////////////////////////////////////////////
+void Protocol_Update(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	if (inFrame && ((now - rxLastByte) > FRAME_TIMEOUT))
+	{
+		inFrame = false;
+		if (rxLength > 0)
+		{
+			stats.badFrames++;
+		}
+	}
+
+	// Go back N, resend everything unacknowledged
+	if ((txBase != txNext) && ((now - txLastSend) > PROTOCOL_RETRY_MS))
+	{
+		for (uint8_t seq = txBase; seq != txNext; seq++)
+		{
+			WindowEntry *entry = &window[seq % PROTOCOL_WINDOW];
+
+			SendFrame(entry->type, seq, entry->payload, entry->length);
+			stats.retransmits++;
+		}
+	}
+
+	if ((0 != telemetryPeriod) && ((now - telemetryLast) >= telemetryPeriod))
+	{
+		telemetryLast = now;
+		SendTelemetry();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Send a reliable frame to the host
+///
+/// @param   type    - MSG_xxx
+/// @param   payload - Frame payload
+/// @param   length  - Up to PROTOCOL_MAX_PAYLOAD bytes
+///
+/// @return  false if the window is full (or the payload too long)
+///////////////////////////////////////////////////////////////////////////////
+bool Protocol_Send(uint8_t type, const uint8_t *payload, uint8_t length)
+{
+	WindowEntry *entry;
+
+	if (length > PROTOCOL_MAX_PAYLOAD)
+	{
+		return false;
+	}
+
+	if ((uint8_t)(txNext - txBase) >= PROTOCOL_WINDOW)
+	{
+		stats.windowFull++;
+		return false;
+	}
+
+	entry         = &window[txNext % PROTOCOL_WINDOW];
+	entry->type   = type;
+	entry->length = length;
+	memcpy(entry->payload, payload, length);
+
+	SendFrame(type, txNext, payload, length);
+	txNext++;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Apply the settings saved in the flash store, call after Store_Init()
+///////////////////////////////////////////////////////////////////////////////
+void Protocol_LoadConfig(void)
+{
+	const uint8_t *value;
+	uint16_t      length;
+
+	for (uint8_t key = 0; key < NUM_CONFIG; key++)
+	{
+		value = Store_Get(STORE_KEY_CONFIG(key), &length);
+
+		if ((NULL != value) && (4 == length))
+		{
+			WriteConfig(key, GetU32(value));
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, show protocol statistics
+///////////////////////////////////////////////////////////////////////////////
+int Protocol_Command(int argc, char *argv[])
+{
+	Output("Frames rx    : %u\r\n", stats.framesRx);
+	Output("Frames tx    : %u\r\n", stats.framesTx);
+	Output("Bad frames   : %u\r\n", stats.badFrames);
+	Output("Out of order : %u\r\n", stats.outOfOrder);
+	Output("Retransmits  : %u\r\n", stats.retransmits);
+	Output("Window full  : %u\r\n", stats.windowFull);
+	Output("Unacked      : %u\r\n", (uint8_t)(txNext - txBase));
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static void SendFrame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t length)
+{
+	uint8_t  body[MAX_BODY];
+	uint8_t  encoded[MAX_ENCODED + 2];
+	uint32_t size = HEADER_SIZE + length;
+	uint16_t crc;
+	uint32_t encodedLength;
+
+	body[0] = type;
+	body[1] = seq;
+	body[2] = rxExpected;
+	if (length > 0)
+	{
+		memcpy(&body[HEADER_SIZE], payload, length);
+	}
+
+	crc = Crc16_Update(CRC16_INIT, body, size);
+	PutU16(&body[size], crc);
+	size += CRC_SIZE;
+
+	encoded[0]    = FRAME_DELIMITER;
+	encodedLength = Cobs_Encode(body, size, &encoded[1]) + 1;
+	encoded[encodedLength++] = FRAME_DELIMITER;
+
+	SendData((const char *)encoded, encodedLength);
+
+	txLastSend = HAL_GetTick();
+	ackSent    = true;
+	stats.framesTx++;
+}
+
+static void ProcessFrame(uint8_t *body, uint32_t length)
+{
+	uint8_t type;
+	uint8_t seq;
+
+	if ((length < HEADER_SIZE + CRC_SIZE) ||
+	    (length > MAX_BODY) ||
+	    (Crc16_Update(CRC16_INIT, body, length - CRC_SIZE) != GetU16(&body[length - CRC_SIZE])))
+	{
+		stats.badFrames++;
+		return;
+	}
+
+	stats.framesRx++;
+
+	type = body[0];
+	seq  = body[1];
+	ProcessAck(body[2]);
+
+	if (MSG_ACK == type)
+	{
+		return;
+	}
+
+	if (MSG_NAK == type)
+	{
+		// Resend on the next update
+		txLastSend = HAL_GetTick() - PROTOCOL_RETRY_MS - 1;
+		return;
+	}
+
+	if (seq != rxExpected)
+	{
+		stats.outOfOrder++;
+
+		// Repeat of something already handled just needs the ack again,
+		// anything else means a frame was lost
+		if ((uint8_t)(rxExpected - seq) <= PROTOCOL_WINDOW)
+		{
+			SendFrame(MSG_ACK, txNext, NULL, 0);
+		}
+		else
+		{
+			SendFrame(MSG_NAK, txNext, NULL, 0);
+		}
+		return;
+	}
+
+	// No room for a reply, leave it unacked and the host will try again
+	if ((uint8_t)(txNext - txBase) >= PROTOCOL_WINDOW)
+	{
+		stats.windowFull++;
+		return;
+	}
+
+	rxExpected++;
+	ackSent = false;
+
+	HandleMessage(type, &body[HEADER_SIZE], (uint8_t)(length - HEADER_SIZE - CRC_SIZE));
+
+	if (!ackSent)
+	{
+		SendFrame(MSG_ACK, txNext, NULL, 0);
+	}
+}
+
+// The host has everything before ack
+static void ProcessAck(uint8_t ack)
+{
+	uint8_t acked = (uint8_t)(ack - txBase);
+
+	if ((acked > 0) && (acked <= (uint8_t)(txNext - txBase)))
+	{
+		txBase = ack;
+		txLastSend = HAL_GetTick();
+	}
+}
+
+static void HandleMessage(uint8_t type, const uint8_t *payload, uint8_t length)
+{
+	switch (type)
+	{
+	case MSG_PING:
+		Protocol_Send(MSG_PONG, payload, length);
+		break;
+
+	case MSG_CONFIG_READ:
+		if (1 != length)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else
+		{
+			SendConfigValue(payload[0]);
+		}
+		break;
+
+	case MSG_CONFIG_WRITE:
+		if (5 != length)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else if (WriteConfig(payload[0], GetU32(&payload[1])))
+		{
+			// Kept as written, so it comes back after a reset
+			Store_Put(STORE_KEY_CONFIG(payload[0]), &payload[1], 4);
+			SendConfigValue(payload[0]);
+		}
+		else
+		{
+			SendError(type, PROTOCOL_ERR_VALUE);
+		}
+		break;
+
+	case MSG_MACRO_WRITE:
+		if (length < 3)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else if (!USB_SetKeyMacro(payload[0], GetU16(&payload[1]), &payload[3], length - 3))
+		{
+			SendError(type, PROTOCOL_ERR_KEY);
+		}
+		break;
+
+	case MSG_LIBRARY_WRITE:
+		if (length < 4)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else if ((GetU16(&payload[0]) >= LIBRARY_SIZE) ||
+		         !Library_Upload(STORE_KEY_LIBRARY(GetU16(&payload[0])), GetU16(&payload[2]), &payload[4], length - 4))
+		{
+			SendError(type, PROTOCOL_ERR_KEY);
+		}
+		break;
+
+	case MSG_LIBRARY_PLAY:
+	{
+		char    name[LIBRARY_NAME_MAX + 1];
+		int32_t id;
+
+		if ((0 == length) || (length > LIBRARY_NAME_MAX))
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+			break;
+		}
+
+		memcpy(name, payload, length);
+		name[length] = 0;
+
+		id = Library_Find(name);
+		if ((LIBRARY_NONE == id) || !Library_Play((uint16_t)id))
+		{
+			SendError(type, PROTOCOL_ERR_KEY);
+		}
+		break;
+	}
+
+	case MSG_PROFILE_WRITE:
+		if ((2 + (KEYMAP_INPUTS * 2)) != length)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else if (!Keymap_SetLayer(payload[0], payload[1], &payload[2], length - 2))
+		{
+			SendError(type, PROTOCOL_ERR_KEY);
+		}
+		break;
+
+	case MSG_COMBO_WRITE:
+		if (4 != length)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else if (!Keymap_SetCombo(payload[0], payload[1], GetU16(&payload[2])))
+		{
+			SendError(type, PROTOCOL_ERR_VALUE);
+		}
+		break;
+
+	case MSG_LEADER_WRITE:
+		if (length < 3)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else if ((payload[0] >= KEYMAP_PROFILES) ||
+		         !Library_Upload(STORE_KEY_LEADER(payload[0]), GetU16(&payload[1]), &payload[3], length - 3))
+		{
+			SendError(type, PROTOCOL_ERR_KEY);
+		}
+		break;
+
+	case MSG_LIBRARY_DELETE:
+		if (2 != length)
+		{
+			SendError(type, PROTOCOL_ERR_LENGTH);
+		}
+		else if (!Library_Delete(GetU16(payload)))
+		{
+			SendError(type, PROTOCOL_ERR_KEY);
+		}
+		break;
+
+	default:
+		SendError(type, PROTOCOL_ERR_TYPE);
+		break;
+	}
+}
+
+static void SendError(uint8_t type, uint8_t reason)
+{
+	uint8_t payload[2] = {type, reason};
+
+	Protocol_Send(MSG_ERROR, payload, sizeof(payload));
+}
+
+static void SendConfigValue(uint8_t key)
+{
+	uint8_t  payload[5];
+	uint32_t value;
+	uint32_t term;
+	uint8_t  mode;
+
+	switch (key)
+	{
+	case CONFIG_OUTPUT_POLICY:
+		value = CLI_GetOutputPolicy();
+		break;
+
+	case CONFIG_TELEMETRY_MS:
+		value = telemetryPeriod;
+		break;
+
+	case CONFIG_SCREEN_FPS:
+		value = ScreenGetFrameRate();
+		break;
+
+	case CONFIG_PROFILE:
+		value = Keymap_GetProfile();
+		break;
+
+	case CONFIG_TAPPING_TERM:
+		Keymap_GetTapping(&value, &mode);
+		break;
+
+	case CONFIG_TAP_MODE:
+		Keymap_GetTapping(&term, &mode);
+		value = mode;
+		break;
+
+	case CONFIG_COMBO_TERM:
+		value = Keymap_GetComboTerm();
+		break;
+
+	case CONFIG_LEADER_TIMEOUT:
+		value = Keymap_GetLeaderTimeout();
+		break;
+
+	case CONFIG_PANIC_KEYS:
+		value = USB_GetPanicKeys();
+		break;
+
+	default:
+		SendError(MSG_CONFIG_READ, PROTOCOL_ERR_KEY);
+		return;
+	}
+
+	payload[0] = key;
+	PutU32(&payload[1], value);
+	Protocol_Send(MSG_CONFIG_VALUE, payload, sizeof(payload));
+}
+
+static bool WriteConfig(uint8_t key, uint32_t value)
+{
+	bool     ret = true;
+	uint32_t term;
+	uint8_t  mode;
+
+	switch (key)
+	{
+	case CONFIG_OUTPUT_POLICY:
+		if (value > OUTPUT_POLICY_ASYNC)
+		{
+			ret = false;
+		}
+		else
+		{
+			CLI_SetOutputPolicy((OutputPolicy)value);
+		}
+		break;
+
+	case CONFIG_TELEMETRY_MS:
+		if (value > MAX_TELEMETRY_MS)
+		{
+			ret = false;
+		}
+		else
+		{
+			telemetryPeriod = value;
+		}
+		break;
+
+	case CONFIG_SCREEN_FPS:
+		if ((value < SCREEN_MIN_FPS) || (value > SCREEN_MAX_FPS))
+		{
+			ret = false;
+		}
+		else
+		{
+			ScreenSetFrameRate(value);
+		}
+		break;
+
+	case CONFIG_PROFILE:
+		ret = (value < KEYMAP_PROFILES) && Keymap_Load((uint8_t)value);
+		break;
+
+	case CONFIG_TAPPING_TERM:
+		Keymap_GetTapping(&term, &mode);
+		ret = Keymap_SetTapping(value, mode);
+		break;
+
+	case CONFIG_TAP_MODE:
+		Keymap_GetTapping(&term, &mode);
+		ret = (value <= 0xFF) && Keymap_SetTapping(term, (uint8_t)value);
+		break;
+
+	case CONFIG_COMBO_TERM:
+		ret = Keymap_SetComboTerm(value);
+		break;
+
+	case CONFIG_LEADER_TIMEOUT:
+		ret = Keymap_SetLeaderTimeout(value);
+		break;
+
+	case CONFIG_PANIC_KEYS:
+		ret = (value <= 0xFF) && USB_SetPanicKeys((uint8_t)value);
+		break;
+
+	default:
+		ret = false;
+		break;
+	}
+
+	return ret;
+}
+
+// tick(4) keys down bitmap(1) key counts(2 x NUM_KEYS) toggle count(2)
+// toggle direction(1) TX bytes dropped(4)
+static void SendTelemetry(void)
+{
+	uint8_t  payload[4 + 1 + (2 * NUM_KEYS) + 2 + 1 + 4];
+	uint8_t  *p = payload;
+	uint8_t  down = 0;
+
+	PutU32(p, HAL_GetTick());
+	p += 4;
+
+	for (int i = 0; i < NUM_KEYS; i++)
+	{
+		if (USB_IsKeyPressed(i))
+		{
+			down |= (1 << i);
+		}
+	}
+	*p++ = down;
+
+	for (int i = 0; i < NUM_KEYS; i++)
+	{
+		PutU16(p, (uint16_t)USB_GetKeycount(i));
+		p += 2;
+	}
+
+	PutU16(p, (uint16_t)USB_GetTogglecount());
+	p += 2;
+	*p++ = USB_GetToggDirection();
+	PutU32(p, CLI_GetTxStats()->droppedBytes);
+
+	// Unacked telemetry just means the host is behind, skip this sample
+	Protocol_Send(MSG_TELEMETRY, payload, sizeof(payload));
+}
+
+static void PutU16(uint8_t *dst, uint16_t value)
+{
+	dst[0] = (uint8_t)value;
+	dst[1] = (uint8_t)(value >> 8);
+}
+
+static void PutU32(uint8_t *dst, uint32_t value)
+{
+	dst[0] = (uint8_t)value;
+	dst[1] = (uint8_t)(value >> 8);
+	dst[2] = (uint8_t)(value >> 16);
+	dst[3] = (uint8_t)(value >> 24);
+}
+
+static uint16_t GetU16(const uint8_t *src)
+{
+	return (uint16_t)(src[0] | (src[1] << 8));
+}
+
+static uint32_t GetU32(const uint8_t *src)
+{
+	return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
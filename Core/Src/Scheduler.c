@@ -0,0 +1,323 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Scheduler.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Cooperative run to completion scheduler
+///
+///             Interrupts raise event flags, each task runs when one of its
+///             events is pending or its period has passed. The highest
+///             priority ready task runs, then everything is looked at again.
+///             With nothing to do the core sleeps in WFI until the next
+///             interrupt. A task that has to wait part way through yields
+///             to the more important ones with Scheduler_Yield(). Time spent
+///             in each task is measured with the DWT cycle counter.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "stm32f4xx_hal.h"
+
+#include "Scheduler.h"
+#include "CLI.h"
+#include "Macro.h"
+#include "Deferred.h"
+#include "Protocol.h"
+#include "Store.h"
+#include "Timer.h"
+#include "screen.h"
+#include "usb_hid_keyboard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define NUM_TASKS		(sizeof(tasks) / sizeof(tasks[0]))
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef void (*TaskFunc)(void);
+
+typedef struct
+{
+	const char	*name;
+	TaskFunc	func;
+	uint8_t		priority;		// 0 is the most important
+	uint32_t	events;			// Events that make the task ready
+	uint32_t	period;			// ms between runs, 0 for event driven only
+
+	// Run time state
+	uint32_t	ready;			// Events pending for this task
+	uint32_t	lastRun;		// HAL_GetTick() of the last periodic run
+	uint32_t	runs;
+	uint64_t	cycles;
+	uint32_t	maxCycles;
+} Task;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t TakeEvents(void);
+static Task     *NextTask(uint8_t below);
+static void     RunTask(Task *task);
+static void     Idle(void);
+static void     ResetStats(void);
+static uint32_t Percent10(uint64_t cycles, uint64_t total);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static Task tasks[] =
+{
+	//  Name      Function            Pri  Events                         Period
+	{"timers", Timer_Process,      0,   EVENT_TICK,                    0},
+	{"keys",   USB_Keyboard_Scan,  1,   EVENT_ENCODER,                 1},
+	{"macros", Macro_Update,       2,   EVENT_MACRO,                   0},
+	{"cli",    CLI_Update,         3,   EVENT_UART_RX | EVENT_UART_TX | EVENT_HID, 0},
+	{"proto",  Protocol_Update,    4,   0,                             10},
+	{"screen", ScreenTick,         5,   0,                             5},
+	{"store",  Store_Update,       6,   0,                             100},
+};
+
+static volatile uint32_t pendingEvents = 0;
+static Task              *current = NULL;	// Task running, innermost if yielding
+
+static uint64_t idleCycles = 0;
+static uint32_t statsStart = 0;			// HAL_GetTick() when the stats were reset
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Start the cycle counter used for task timing
+///////////////////////////////////////////////////////////////////////////////
+void Scheduler_Init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT       = 0;
+	DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+
+	// Keep the debugger connected while the core sleeps
+	DBGMCU->CR |= DBGMCU_CR_DBG_SLEEP;
+
+	ResetStats();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Run the most important ready task, or sleep until an interrupt.
+///          Called by Main() forever
+///////////////////////////////////////////////////////////////////////////////
+void Scheduler_Run(void)
+{
+	Task *next = NextTask(UINT8_MAX);
+
+	if (NULL != next)
+	{
+		RunTask(next);
+	}
+	else
+	{
+		Idle();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   For a task that has to wait part way through. Runs one ready task
+///          more important than the caller, or sleeps until an interrupt.
+///          Call in a loop until whatever is waited for has happened. Less
+///          important tasks, and the caller itself, do not run until it
+///          returns, so nothing is entered twice.
+///////////////////////////////////////////////////////////////////////////////
+void Scheduler_Yield(void)
+{
+	Task *next = NULL;
+
+	// Before Scheduler_Run() has started there is nothing to run
+	if (NULL != current)
+	{
+		next = NextTask(current->priority);
+	}
+
+	if (NULL != next)
+	{
+		RunTask(next);
+	}
+	else
+	{
+		Idle();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Raise events, safe to call from any interrupt
+///
+/// @param   events - EVENT_xxx flags
+///////////////////////////////////////////////////////////////////////////////
+void Scheduler_Signal(uint32_t events)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	pendingEvents |= events;
+	__set_PRIMASK(primask);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, show where the CPU time goes
+///////////////////////////////////////////////////////////////////////////////
+int Scheduler_Command(int argc, char *argv[])
+{
+	uint64_t total = (uint64_t)(HAL_GetTick() - statsStart) * (SystemCoreClock / 1000);
+	uint32_t cyclesPerUs = SystemCoreClock / 1000000;
+
+	if (argc > 1)
+	{
+		if (0 != strcmp(argv[1], "reset"))
+		{
+			return CLI_ERROR_ARGS;
+		}
+
+		ResetStats();
+		return CLI_OK;
+	}
+
+	Output("Task     Pri  Runs        Time ms   Max us  CPU\r\n");
+
+	for (uint32_t i = 0; i < NUM_TASKS; i++)
+	{
+		Task     *task = &tasks[i];
+		uint32_t cpu   = Percent10(task->cycles, total);
+
+		Output("%-8s %3u  %-10u  %8u  %7u  %u.%u%%\r\n",
+		       task->name,
+		       task->priority,
+		       task->runs,
+		       (uint32_t)(task->cycles / (cyclesPerUs * 1000)),
+		       task->maxCycles / cyclesPerUs,
+		       cpu / 10, cpu % 10);
+	}
+
+	uint32_t idle = Percent10(idleCycles, total);
+	Output("%-8s                  %8u           %u.%u%%\r\n",
+	       "idle", (uint32_t)(idleCycles / (cyclesPerUs * 1000)), idle / 10, idle % 10);
+
+	const DeferredStats_t *deferred = Deferred_GetStats();
+	Output("PendSV jobs %u run, %u queued, %u merged, max %u us\r\n",
+	       deferred->runs, deferred->queued, deferred->merged,
+	       deferred->maxCycles / cyclesPerUs);
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t TakeEvents(void)
+{
+	uint32_t events;
+
+	__disable_irq();
+	events        = pendingEvents;
+	pendingEvents = 0;
+	__enable_irq();
+
+	return events;
+}
+
+// The most important ready task with a priority number below the one given
+static Task *NextTask(uint8_t below)
+{
+	uint32_t events = TakeEvents();
+	uint32_t now    = HAL_GetTick();
+	Task     *next  = NULL;
+
+	for (uint32_t i = 0; i < NUM_TASKS; i++)
+	{
+		Task *task = &tasks[i];
+
+		task->ready |= (events & task->events);
+
+		if ((0 != task->period) && ((now - task->lastRun) >= task->period))
+		{
+			task->ready  |= EVENT_TICK;
+			task->lastRun = now;
+		}
+
+		if ((0 != task->ready) && (task->priority < below) &&
+		    ((NULL == next) || (task->priority < next->priority)))
+		{
+			next = task;
+		}
+	}
+
+	return next;
+}
+
+// A yielding task's time includes the tasks run while it waited
+static void RunTask(Task *task)
+{
+	uint32_t start  = DWT->CYCCNT;
+	Task     *outer = current;
+	uint32_t cycles;
+
+	task->ready = 0;
+	current     = task;
+	task->func();
+	current     = outer;
+
+	cycles = DWT->CYCCNT - start;
+	task->runs++;
+	task->cycles += cycles;
+	if (cycles > task->maxCycles)
+	{
+		task->maxCycles = cycles;
+	}
+}
+
+// Sleep until an interrupt. Interrupts are masked while checking for events so
+// one arriving between the check and the WFI still wakes the core.
+static void Idle(void)
+{
+	uint32_t start = DWT->CYCCNT;
+
+	__disable_irq();
+	if (0 == pendingEvents)
+	{
+		__DSB();
+		__WFI();
+	}
+	__enable_irq();
+
+	// A yielding task is charged for its own wait
+	if (NULL == current)
+	{
+		idleCycles += DWT->CYCCNT - start;
+	}
+}
+
+static void ResetStats(void)
+{
+	for (uint32_t i = 0; i < NUM_TASKS; i++)
+	{
+		tasks[i].runs      = 0;
+		tasks[i].cycles    = 0;
+		tasks[i].maxCycles = 0;
+	}
+
+	idleCycles = 0;
+	statsStart = HAL_GetTick();
+}
+
+// Share of total in tenths of a percent
+static uint32_t Percent10(uint64_t cycles, uint64_t total)
+{
+	return (0 == total) ? 0 : (uint32_t)((cycles * 1000) / total);
+}
@@ -0,0 +1,674 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Store.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Log structured key/value store in internal flash
+///
+///             Flash sectors 10 and 11 (128K each, kept out of the program
+///             by the linker script) take turns holding the log. A sector
+///             starts with a header :
+///
+///                 magic(4) generation(4)
+///
+///             followed by records, each padded to a multiple of 4 bytes :
+///
+///                 key(2) length(2) crc(2) spare(2) value(length)
+///
+///             Records are only ever appended, the newest record for a key
+///             wins and a zero length record deletes it. The CRC covers key,
+///             length and value, a record that fails it was torn by a reset
+///             and is skipped. When the log is full the live records are
+///             copied into the other sector, which then takes over with the
+///             next generation number, so erases are shared between both.
+///
+///             A hash table in RAM maps each live key to its record, so
+///             lookups never scan the log. Values are returned as pointers
+///             into flash, nothing is copied. Appending never moves a record,
+///             and a collection leaves the old sector as it was. Anything
+///             that keeps a pointer past a collection, such as a playing
+///             macro, pins it.
+///
+///             Erasing a sector stalls the whole flash bank for a second or
+///             two, see Flash.c, so it is kept away from saves. Store_Update()
+///             erases the retired sector in the background once nothing has
+///             it pinned, and collects early when the log is getting full, so
+///             a save normally only has to program.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+#include <string.h>
+
+#include "stm32f4xx_hal.h"
+
+#include "Store.h"
+#include "CLI.h"
+#include "Crc16.h"
+#include "Flash.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define NUM_SECTORS		2
+#define SECTOR_SIZE		0x20000
+#define STORE_MAGIC		0x3153564BUL	// "KVS1"
+
+#define INDEX_SIZE		2048			// Power of 2, well over STORE_MAX_KEYS
+#define INDEX_MASK		(INDEX_SIZE - 1)
+#define NO_KEY			0xFFFF			// Erased flash, also an empty index slot
+
+#define PAD4(n)			(((n) + 3UL) & ~3UL)
+
+#define COLLECT_AT		((SECTOR_SIZE * 3) / 4)	// Log size to collect at in the background
+#define COLLECT_LIVE	(SECTOR_SIZE / 2)		// As long as this much would be freed
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	uint32_t	magic;
+	uint32_t	generation;
+} SectorHeader;
+
+typedef struct
+{
+	uint16_t	key;
+	uint16_t	length;
+	uint16_t	crc;
+	uint16_t	spare;
+} RecordHeader;
+
+typedef struct
+{
+	uint32_t	address;
+	uint32_t	sector;			// FLASH_SECTOR_xx
+} Sector;
+
+typedef struct
+{
+	uint16_t	key;
+	uint16_t	offset;			// Of the record header in the active sector, in words
+} IndexEntry;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static bool      Mount(uint32_t sector);
+static bool      Format(uint32_t sector, uint32_t generation);
+static bool      Collect(void);
+static bool      Append(uint16_t key, const void *data, uint16_t length);
+static bool      Program(uint32_t address, const void *data, uint32_t length);
+static bool      Erase(uint32_t sector);
+static uint16_t  RecordCrc(uint16_t key, const void *data, uint16_t length);
+static const RecordHeader *Record(uint32_t offset);
+static int32_t   SectorOf(const void *data);
+static bool      IsErased(uint32_t sector);
+
+static uint32_t    Hash(uint16_t key);
+static IndexEntry *IndexFind(uint16_t key);
+static bool        IndexSet(uint16_t key, uint32_t offset);
+static void        IndexRemove(uint16_t key);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static const Sector sectors[NUM_SECTORS] =
+{
+	{0x080C0000, FLASH_SECTOR_10},
+	{0x080E0000, FLASH_SECTOR_11},
+};
+
+static uint32_t		active = 0;			// Sector holding the log
+static uint32_t		generation = 0;
+static uint32_t		writeOffset = 0;	// Where the next record goes
+static uint32_t		liveBytes = 0;		// Bytes of records still in use
+
+static IndexEntry	keyIndex[INDEX_SIZE];
+static uint32_t		numKeys = 0;
+
+static uint32_t		collections = 0;	// Since power up
+static uint8_t		pins[NUM_SECTORS];	// Pointers into each sector still in use
+static bool			spareDirty = true;	// The other sector needs erasing before use
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Find the newest valid sector and build the index from its log.
+///          An empty store is formatted.
+///////////////////////////////////////////////////////////////////////////////
+void Store_Init(void)
+{
+	const SectorHeader *header;
+	int32_t            best = -1;
+
+	for (uint32_t i = 0; i < NUM_SECTORS; i++)
+	{
+		header = (const SectorHeader *)sectors[i].address;
+
+		if ((STORE_MAGIC == header->magic) &&
+		    ((best < 0) || ((int32_t)(header->generation - generation) > 0)))
+		{
+			best       = i;
+			generation = header->generation;
+		}
+	}
+
+	if ((best < 0) || !Mount(best))
+	{
+		if (!Format(0, 1))
+		{
+			Message("Flash store format failed");
+		}
+	}
+
+	spareDirty = !IsErased((active + 1) % NUM_SECTORS);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Look up a value
+///
+/// @param   key    - Key to find
+/// @param   length - Receives the size of the value, may be NULL
+///
+/// @return  Pointer to the value in flash, NULL if the key is not stored.
+///          Stays valid until the next garbage collection, unless pinned.
+///////////////////////////////////////////////////////////////////////////////
+const uint8_t *Store_Get(uint16_t key, uint16_t *length)
+{
+	IndexEntry         *entry = IndexFind(key);
+	const RecordHeader *record;
+
+	if (NULL == entry)
+	{
+		return NULL;
+	}
+
+	record = Record(entry->offset * 4);
+	if (NULL != length)
+	{
+		*length = record->length;
+	}
+
+	return (const uint8_t *)(record + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Store a value, replacing any older one
+///
+/// @param   key    - Any key except 0xFFFF
+/// @param   data   - Value to store
+/// @param   length - 1 to STORE_MAX_VALUE bytes
+///
+/// @return  false if the value is bad or the store is full
+///////////////////////////////////////////////////////////////////////////////
+bool Store_Put(uint16_t key, const void *data, uint16_t length)
+{
+	const uint8_t *old;
+	uint16_t      oldLength;
+
+	if ((NO_KEY == key) || (0 == length) || (length > STORE_MAX_VALUE))
+	{
+		return false;
+	}
+
+	// Save the wear when nothing has changed
+	old = Store_Get(key, &oldLength);
+	if ((NULL != old) && (oldLength == length) && (0 == memcmp(old, data, length)))
+	{
+		return true;
+	}
+
+	if ((NULL == old) && (numKeys >= STORE_MAX_KEYS))
+	{
+		return false;
+	}
+
+	return Append(key, data, length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Remove a key, harmless if it is not stored
+///////////////////////////////////////////////////////////////////////////////
+bool Store_Delete(uint16_t key)
+{
+	if (NULL == IndexFind(key))
+	{
+		return true;
+	}
+
+	return Append(key, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Keep a value from Store_Get() readable until Store_Unpin()
+///
+/// @param   data - Pointer from Store_Get(), anything else is ignored
+///////////////////////////////////////////////////////////////////////////////
+void Store_Pin(const void *data)
+{
+	int32_t sector = SectorOf(data);
+
+	if (sector >= 0)
+	{
+		pins[sector]++;
+	}
+}
+
+void Store_Unpin(const void *data)
+{
+	int32_t sector = SectorOf(data);
+
+	if ((sector >= 0) && (pins[sector] > 0))
+	{
+		pins[sector]--;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Background upkeep, scheduler task. Erases the retired sector and
+///          collects ahead of time, one erase per run at most.
+///////////////////////////////////////////////////////////////////////////////
+void Store_Update(void)
+{
+	uint32_t spare = (active + 1) % NUM_SECTORS;
+
+	if (0 != pins[spare])
+	{
+		return;
+	}
+
+	if (spareDirty)
+	{
+		spareDirty = !Erase(spare);
+	}
+	else if ((writeOffset >= COLLECT_AT) && (liveBytes <= COLLECT_LIVE))
+	{
+		Collect();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, show store usage or force a garbage collection
+///////////////////////////////////////////////////////////////////////////////
+int Store_Command(int argc, char *argv[])
+{
+	if (argc > 1)
+	{
+		if (0 != strcmp(argv[1], "gc"))
+		{
+			return CLI_ERROR_ARGS;
+		}
+
+		if (!Collect())
+		{
+			Message("Garbage collection failed");
+			return CLI_ERROR;
+		}
+	}
+
+	Output("Sector     : %u, generation %u\r\n", (active == 0) ? 10 : 11, generation);
+	Output("Keys       : %u / %u\r\n", numKeys, STORE_MAX_KEYS);
+	Output("Log        : %u / %u bytes, %u live\r\n", writeOffset, SECTOR_SIZE, liveBytes);
+	Output("Collected  : %u times\r\n", collections);
+	Output("Spare      : %s\r\n", spareDirty ? "to be erased" : "erased");
+	Output("Erases     : %u, last %u ms, longest %u ms\r\n",
+	       Flash_GetStats()->erases, Flash_GetStats()->lastMs, Flash_GetStats()->maxMs);
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Walk the log of a sector, indexing the newest record of each key
+static bool Mount(uint32_t sector)
+{
+	uint32_t           offset = sizeof(SectorHeader);
+	const RecordHeader *record;
+
+	memset(keyIndex, 0xFF, sizeof(keyIndex));
+	numKeys   = 0;
+	liveBytes = 0;
+	active    = sector;
+
+	while ((offset + sizeof(RecordHeader)) <= SECTOR_SIZE)
+	{
+		record = Record(offset);
+
+		// Erased, end of the log
+		if ((NO_KEY == record->key) && (0xFFFF == record->length))
+		{
+			break;
+		}
+
+		// A length that runs off the end can not be skipped, stop appending here
+		if ((record->length > STORE_MAX_VALUE) ||
+		    ((offset + sizeof(RecordHeader) + record->length) > SECTOR_SIZE))
+		{
+			offset = SECTOR_SIZE;
+			break;
+		}
+
+		if (record->crc == RecordCrc(record->key, record + 1, record->length))
+		{
+			IndexEntry *entry = IndexFind(record->key);
+
+			if (NULL != entry)
+			{
+				liveBytes -= sizeof(RecordHeader) + PAD4(Record(entry->offset * 4)->length);
+			}
+
+			if (0 == record->length)
+			{
+				IndexRemove(record->key);
+			}
+			else if (IndexSet(record->key, offset))
+			{
+				liveBytes += sizeof(RecordHeader) + PAD4(record->length);
+			}
+		}
+
+		offset += sizeof(RecordHeader) + PAD4(record->length);
+	}
+
+	writeOffset = offset;
+
+	return true;
+}
+
+// Erase a sector and start an empty log in it
+static bool Format(uint32_t sector, uint32_t newGeneration)
+{
+	SectorHeader header = {STORE_MAGIC, newGeneration};
+
+	if (!Erase(sector) || !Program(sectors[sector].address, &header, sizeof(header)))
+	{
+		return false;
+	}
+
+	memset(keyIndex, 0xFF, sizeof(keyIndex));
+	numKeys     = 0;
+	liveBytes   = 0;
+	active      = sector;
+	generation  = newGeneration;
+	writeOffset = sizeof(SectorHeader);
+
+	return true;
+}
+
+// Copy the live records into the other sector, which becomes active. The new
+// header goes in last, so a reset part way through leaves the old log in use.
+static bool Collect(void)
+{
+	uint32_t     target = (active + 1) % NUM_SECTORS;
+	uint32_t     offset = sizeof(SectorHeader);
+	SectorHeader header = {STORE_MAGIC, generation + 1};
+
+	// Something is still reading the last generation, try again later
+	if (0 != pins[target])
+	{
+		return false;
+	}
+
+	// Normally done already by Store_Update()
+	if (spareDirty && !Erase(target))
+	{
+		return false;
+	}
+
+	// Whatever happens now the target needs erasing before it is used again
+	spareDirty = true;
+
+	for (uint32_t i = 0; i < INDEX_SIZE; i++)
+	{
+		if (NO_KEY != keyIndex[i].key)
+		{
+			const RecordHeader *record = Record(keyIndex[i].offset * 4);
+			uint32_t           size    = sizeof(RecordHeader) + PAD4(record->length);
+
+			if (!Program(sectors[target].address + offset, record, size))
+			{
+				return false;
+			}
+
+			offset += size;
+		}
+	}
+
+	if (!Program(sectors[target].address, &header, sizeof(header)))
+	{
+		return false;
+	}
+
+	// Only now point the index at the copies, in the same order
+	offset = sizeof(SectorHeader);
+	for (uint32_t i = 0; i < INDEX_SIZE; i++)
+	{
+		if (NO_KEY != keyIndex[i].key)
+		{
+			uint32_t size = sizeof(RecordHeader) + PAD4(Record(keyIndex[i].offset * 4)->length);
+
+			keyIndex[i].offset = offset / 4;
+			offset            += size;
+		}
+	}
+
+	active      = target;
+	generation  = header.generation;
+	writeOffset = offset;
+	liveBytes   = offset - sizeof(SectorHeader);
+	collections++;
+
+	return true;
+}
+
+// Add a record to the end of the log, collecting first if it will not fit
+static bool Append(uint16_t key, const void *data, uint16_t length)
+{
+	RecordHeader header;
+	uint32_t     size = sizeof(RecordHeader) + PAD4(length);
+	uint32_t     address;
+	IndexEntry   *entry;
+
+	if ((writeOffset + size) > SECTOR_SIZE)
+	{
+		if (!Collect() || ((writeOffset + size) > SECTOR_SIZE))
+		{
+			return false;
+		}
+	}
+
+	header.key    = key;
+	header.length = length;
+	header.crc    = RecordCrc(key, data, length);
+	header.spare  = 0xFFFF;
+
+	// Header first, a torn value then fails its CRC but can still be skipped
+	address = sectors[active].address + writeOffset;
+	if (!Program(address, &header, sizeof(header)) ||
+	    !Program(address + sizeof(header), data, length))
+	{
+		// Whatever was written is skipped when the log is next mounted
+		writeOffset += size;
+		return false;
+	}
+
+	entry = IndexFind(key);
+	if (NULL != entry)
+	{
+		liveBytes -= sizeof(RecordHeader) + PAD4(Record(entry->offset * 4)->length);
+	}
+
+	if (0 == length)
+	{
+		IndexRemove(key);
+	}
+	else
+	{
+		IndexSet(key, writeOffset);
+		liveBytes += size;
+	}
+
+	writeOffset += size;
+
+	return true;
+}
+
+// Write whole words, the last one padded with erased bytes
+static bool Program(uint32_t address, const void *data, uint32_t length)
+{
+	const uint8_t *bytes = data;
+	bool          ret    = true;
+
+	HAL_FLASH_Unlock();
+
+	for (uint32_t i = 0; (i < length) && ret; i += 4)
+	{
+		uint32_t word = 0xFFFFFFFF;
+
+		memcpy(&word, &bytes[i], ((length - i) < 4) ? (length - i) : 4);
+		ret = (HAL_OK == HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + i, word));
+	}
+
+	HAL_FLASH_Lock();
+
+	return ret;
+}
+
+// Runs from RAM, the keys and USB carry on meanwhile
+static bool Erase(uint32_t sector)
+{
+	return Flash_EraseSector(sectors[sector].sector);
+}
+
+// Whether a sector is blank, so a reset does not cost an erase
+static bool IsErased(uint32_t sector)
+{
+	const uint32_t *word = (const uint32_t *)sectors[sector].address;
+
+	for (uint32_t i = 0; i < (SECTOR_SIZE / 4); i++)
+	{
+		if (0xFFFFFFFF != word[i])
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint16_t RecordCrc(uint16_t key, const void *data, uint16_t length)
+{
+	uint16_t head[2] = {key, length};
+	uint16_t crc;
+
+	crc = Crc16_Update(CRC16_INIT, (const uint8_t *)head, sizeof(head));
+	return Crc16_Update(crc, data, length);
+}
+
+static const RecordHeader *Record(uint32_t offset)
+{
+	return (const RecordHeader *)(sectors[active].address + offset);
+}
+
+// Which sector a pointer is in, -1 for neither
+static int32_t SectorOf(const void *data)
+{
+	uint32_t address = (uint32_t)data;
+
+	for (uint32_t i = 0; i < NUM_SECTORS; i++)
+	{
+		if ((address >= sectors[i].address) && (address < (sectors[i].address + SECTOR_SIZE)))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Open addressed hash table, linear probing
+static uint32_t Hash(uint16_t key)
+{
+	return (key * 40503UL) >> 8;
+}
+
+static IndexEntry *IndexFind(uint16_t key)
+{
+	for (uint32_t i = Hash(key), n = 0; n < INDEX_SIZE; i++, n++)
+	{
+		IndexEntry *entry = &keyIndex[i & INDEX_MASK];
+
+		if (key == entry->key)
+		{
+			return entry;
+		}
+		if (NO_KEY == entry->key)
+		{
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static bool IndexSet(uint16_t key, uint32_t offset)
+{
+	for (uint32_t i = Hash(key), n = 0; n < INDEX_SIZE; i++, n++)
+	{
+		IndexEntry *entry = &keyIndex[i & INDEX_MASK];
+
+		if ((key == entry->key) || (NO_KEY == entry->key))
+		{
+			if ((NO_KEY == entry->key) && (numKeys >= STORE_MAX_KEYS))
+			{
+				return false;
+			}
+
+			numKeys      += (NO_KEY == entry->key) ? 1 : 0;
+			entry->key    = key;
+			entry->offset = offset / 4;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Remove an entry, moving later ones of the same probe run back into the gap
+static void IndexRemove(uint16_t key)
+{
+	IndexEntry *entry = IndexFind(key);
+	uint32_t   gap;
+	uint32_t   i;
+
+	if (NULL == entry)
+	{
+		return;
+	}
+
+	gap        = entry - keyIndex;
+	entry->key = NO_KEY;
+	numKeys--;
+
+	for (i = (gap + 1) & INDEX_MASK; NO_KEY != keyIndex[i].key; i = (i + 1) & INDEX_MASK)
+	{
+		uint32_t home = Hash(keyIndex[i].key) & INDEX_MASK;
+
+		// Move it back if its home is not between the gap and where it is
+		if (((i - home) & INDEX_MASK) >= ((i - gap) & INDEX_MASK))
+		{
+			keyIndex[gap]   = keyIndex[i];
+			keyIndex[i].key = NO_KEY;
+			gap             = i;
+		}
+	}
+}
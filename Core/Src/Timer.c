@@ -0,0 +1,235 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Timer.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Hierarchical software timer wheel, 1ms resolution
+///
+///             Three wheels of slots, each slot a list of timers :
+///
+///                 level 0 : 256 x 1ms      (next 256ms)
+///                 level 1 :  64 x 256ms    (next 16s)
+///                 level 2 :  64 x 16384ms  (next 17 minutes)
+///
+///             Starting and stopping a timer is a list insert or remove.
+///             Each time level 0 wraps, the next level 1 slot is spread back
+///             down into level 0 (and level 2 into level 1 likewise).
+///
+///             Timer_Process() runs from the scheduler on every SysTick, so
+///             callbacks run in task context and timers must only be started
+///             or stopped from task context, never from an interrupt.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+
+#include "stm32f4xx_hal.h"
+
+#include "Timer.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define L0_BITS		8
+#define LN_BITS		6
+#define L0_SIZE		(1UL << L0_BITS)
+#define LN_SIZE		(1UL << LN_BITS)
+#define L0_MASK		(L0_SIZE - 1)
+#define LN_MASK		(LN_SIZE - 1)
+
+#define L1_SHIFT	L0_BITS
+#define L2_SHIFT	(L0_BITS + LN_BITS)
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static void AddTimer(Timer *timer);
+static void Cascade(Timer **slot);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static Timer	*level0[L0_SIZE];
+static Timer	*level1[LN_SIZE];
+static Timer	*level2[LN_SIZE];
+
+static uint32_t	wheelTime = 0;			// Next tick to process
+static bool		started = false;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set up a timer before first use
+///
+/// @param   timer    - Timer to set up
+/// @param   callback - Called when the timer expires
+/// @param   context  - Stored in timer->context for the callback
+///////////////////////////////////////////////////////////////////////////////
+void Timer_Init(Timer *timer, TimerCallback callback, void *context)
+{
+	timer->next     = NULL;
+	timer->pprev    = NULL;
+	timer->expires  = 0;
+	timer->callback = callback;
+	timer->context  = context;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Start, or restart, a one shot timer
+///
+/// @param   timer - Timer set up by Timer_Init()
+/// @param   delay - ms from now, at least 1ms is always allowed to pass
+///////////////////////////////////////////////////////////////////////////////
+void Timer_Start(Timer *timer, uint32_t delay)
+{
+	uint32_t now = HAL_GetTick();
+
+	if (!started)
+	{
+		wheelTime = now;
+		started   = true;
+	}
+
+	Timer_Stop(timer);
+
+	if (delay > TIMER_MAX_DELAY)
+	{
+		delay = TIMER_MAX_DELAY;
+	}
+	if (0 == delay)
+	{
+		delay = 1;
+	}
+
+	timer->expires = now + delay;
+	AddTimer(timer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Stop a timer, harmless if it is not running
+///////////////////////////////////////////////////////////////////////////////
+void Timer_Stop(Timer *timer)
+{
+	if (NULL != timer->pprev)
+	{
+		*timer->pprev = timer->next;
+		if (NULL != timer->next)
+		{
+			timer->next->pprev = timer->pprev;
+		}
+
+		timer->next  = NULL;
+		timer->pprev = NULL;
+	}
+}
+
+bool Timer_IsActive(const Timer *timer)
+{
+	return (NULL != timer->pprev);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Run the callbacks of every timer that has expired.
+///          Called by the scheduler on each SysTick.
+///////////////////////////////////////////////////////////////////////////////
+void Timer_Process(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	if (!started)
+	{
+		return;
+	}
+
+	// Catch up one tick at a time if we have been held up
+	while ((int32_t)(now - wheelTime) >= 0)
+	{
+		uint32_t index = wheelTime & L0_MASK;
+
+		if (0 == index)
+		{
+			uint32_t index1 = (wheelTime >> L1_SHIFT) & LN_MASK;
+
+			if (0 == index1)
+			{
+				Cascade(&level2[(wheelTime >> L2_SHIFT) & LN_MASK]);
+			}
+			Cascade(&level1[index1]);
+		}
+
+		// Detach the slot first, a callback may start its timer again
+		Timer *expired = level0[index];
+		level0[index]  = NULL;
+		if (NULL != expired)
+		{
+			expired->pprev = &expired;
+		}
+
+		while (NULL != expired)
+		{
+			Timer *timer = expired;
+
+			Timer_Stop(timer);
+			timer->callback(timer);
+		}
+
+		wheelTime++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static void AddTimer(Timer *timer)
+{
+	int32_t  delta = (int32_t)(timer->expires - wheelTime);
+	Timer    **slot;
+
+	if (delta < 0)
+	{
+		// Already due, fire on the next tick processed
+		slot = &level0[wheelTime & L0_MASK];
+	}
+	else if (delta < (int32_t)L0_SIZE)
+	{
+		slot = &level0[timer->expires & L0_MASK];
+	}
+	else if (delta < (int32_t)(1UL << L2_SHIFT))
+	{
+		slot = &level1[(timer->expires >> L1_SHIFT) & LN_MASK];
+	}
+	else
+	{
+		slot = &level2[(timer->expires >> L2_SHIFT) & LN_MASK];
+	}
+
+	timer->next = *slot;
+	if (NULL != timer->next)
+	{
+		timer->next->pprev = &timer->next;
+	}
+	timer->pprev = slot;
+	*slot        = timer;
+}
+
+// Move every timer in a higher level slot down to where it now belongs
+static void Cascade(Timer **slot)
+{
+	Timer *timer = *slot;
+
+	*slot = NULL;
+
+	while (NULL != timer)
+	{
+		Timer *next = timer->next;
+
+		AddTimer(timer);
+		timer = next;
+	}
+}
@@ -0,0 +1,298 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Turbo.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Turbo and typematic key repeat
+///
+///             A key bound to ACTION_TURBO taps a HID usage over and over
+///             while it is held, at its own rate. With a delay it taps once,
+///             waits, then repeats like typematic, without a delay it is
+///             turbo.
+///
+///             Time is counted in USB frames, the host's 1ms clock, so taps
+///             line up with the frames the host polls in and rates are the
+///             host's idea of a Hz. Each key's next tap is kept as a frame
+///             number with a 16 bit fraction, advanced by exactly one period
+///             per tap, so rates like 3Hz do not drift and a tap made late
+///             does not push the ones after it back. The timer wheel wakes
+///             each key when its next tap is due. If the scheduler was held
+///             up past that, by the CLI or the screen, the taps owed are
+///             made at once, and how late they were is kept for the "turbo"
+///             command.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+
+#include "Turbo.h"
+#include "CLI.h"
+#include "Store.h"
+#include "Timer.h"
+#include "usb_hid_keyboard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define FRACTION_BITS		16
+#define SETTING_BYTES		4		// hz(2) delay(2) in the store
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	bool		active;
+	uint8_t		usage;
+	uint16_t	hz;
+	uint16_t	delay;			// ms
+	uint32_t	period;			// Frames per tap, 16 bit fraction
+	uint32_t	due;			// Frame of the next tap, 16 bit fraction, wraps
+	Timer		timer;
+} TurboKey;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function declarations
+///////////////////////////////////////////////////////////////////////////////
+static void TurboDue(Timer *timer);
+static void Tap(TurboKey *key);
+static void Schedule(TurboKey *key, uint32_t now);
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static TurboKey		turbo[NUM_KEYS];
+static TurboStats_t	stats = {0};
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Load each key's rate from the store, call after Store_Init()
+///////////////////////////////////////////////////////////////////////////////
+void Turbo_Init(void)
+{
+	const uint8_t *value;
+	uint16_t      length;
+
+	for (uint8_t i = 0; i < NUM_KEYS; i++)
+	{
+		turbo[i].active = false;
+		turbo[i].hz     = TURBO_HZ;
+		turbo[i].delay  = TURBO_DELAY;
+		Timer_Init(&turbo[i].timer, TurboDue, &turbo[i]);
+
+		value = Store_Get(STORE_KEY_TURBO(i), &length);
+		if ((NULL != value) && (SETTING_BYTES == length))
+		{
+			turbo[i].hz    = value[0] | (value[1] << 8);
+			turbo[i].delay = value[2] | (value[3] << 8);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Start repeating, the first tap is made straight away
+///
+/// @param   key   - KEY_1 to KEY_R
+/// @param   usage - HID usage to tap
+///////////////////////////////////////////////////////////////////////////////
+void Turbo_Start(uint8_t key, uint8_t usage)
+{
+	TurboKey *k;
+	uint32_t now;
+
+	if (key >= NUM_KEYS)
+	{
+		return;
+	}
+
+	k         = &turbo[key];
+	now       = USB_Keyboard_Frame();
+	k->active = true;
+	k->usage  = usage;
+	k->period = (1000UL << FRACTION_BITS) / k->hz;
+
+	if (USB_Keyboard_QueueSpace() >= 2)
+	{
+		Tap(k);
+		stats.taps++;
+	}
+	else
+	{
+		stats.missed++;
+	}
+
+	// Typematic waits the delay before the repeats, turbo one period
+	k->due = (now << FRACTION_BITS) + ((0 != k->delay) ? ((uint32_t)k->delay << FRACTION_BITS) : k->period);
+	Schedule(k, now);
+}
+
+void Turbo_Stop(uint8_t key)
+{
+	if (key < NUM_KEYS)
+	{
+		turbo[key].active = false;
+		Timer_Stop(&turbo[key].timer);
+	}
+}
+
+void Turbo_StopAll(void)
+{
+	for (uint8_t i = 0; i < NUM_KEYS; i++)
+	{
+		Turbo_Stop(i);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set and save how fast a key repeats
+///
+/// @param   key   - KEY_1 to KEY_R
+/// @param   hz    - TURBO_MIN_HZ to TURBO_MAX_HZ
+/// @param   delay - ms before repeating starts, 0 to TURBO_MAX_DELAY
+///
+/// @return  false if out of range or the store could not save it
+///////////////////////////////////////////////////////////////////////////////
+bool Turbo_SetRate(uint8_t key, uint16_t hz, uint16_t delay)
+{
+	uint8_t value[SETTING_BYTES];
+
+	if ((key >= NUM_KEYS) || (hz < TURBO_MIN_HZ) || (hz > TURBO_MAX_HZ) || (delay > TURBO_MAX_DELAY))
+	{
+		return false;
+	}
+
+	value[0] = (uint8_t)hz;
+	value[1] = (uint8_t)(hz >> 8);
+	value[2] = (uint8_t)delay;
+	value[3] = (uint8_t)(delay >> 8);
+
+	if (!Store_Put(STORE_KEY_TURBO(key), value, sizeof(value)))
+	{
+		return false;
+	}
+
+	turbo[key].hz     = hz;
+	turbo[key].delay  = delay;
+	turbo[key].period = (1000UL << FRACTION_BITS) / hz;
+
+	return true;
+}
+
+const TurboStats_t *Turbo_GetStats(void)
+{
+	return &stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, show the rates and how well they were kept, or set
+///          a key's rate
+///////////////////////////////////////////////////////////////////////////////
+int Turbo_Command(int argc, char *argv[])
+{
+	int32_t  key;
+	int32_t  hz;
+	int32_t  delay = TURBO_DELAY;
+	uint32_t mean;
+
+	if (2 == argc)
+	{
+		return CLI_ERROR_ARGS;
+	}
+
+	if (argc > 2)
+	{
+		if (!CLI_ParseInt(argv[1], 0, NUM_KEYS - 1, &key) ||
+		    !CLI_ParseInt(argv[2], TURBO_MIN_HZ, TURBO_MAX_HZ, &hz) ||
+		    ((argc > 3) && !CLI_ParseInt(argv[3], 0, TURBO_MAX_DELAY, &delay)))
+		{
+			return CLI_ERROR_ARGS;
+		}
+
+		if (!Turbo_SetRate((uint8_t)key, (uint16_t)hz, (uint16_t)delay))
+		{
+			Message("Could not save the rate");
+			return CLI_ERROR;
+		}
+	}
+
+	for (uint8_t i = 0; i < NUM_KEYS; i++)
+	{
+		Output("Key %u : %3u Hz, delay %4u ms%s\r\n", i, turbo[i].hz, turbo[i].delay,
+				turbo[i].active ? ", repeating" : "");
+	}
+
+	mean = (0 == stats.taps) ? 0 : ((stats.lateSum * 100) / stats.taps);
+
+	Output("Taps   : %u\r\n", stats.taps);
+	Output("Missed : %u\r\n", stats.missed);
+	Output("Late   : mean %u.%02u, max %u frames\r\n", mean / 100, mean % 100, stats.lateMax);
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// Make every tap that is due
+static void TurboDue(Timer *timer)
+{
+	TurboKey *key = timer->context;
+	uint32_t now  = USB_Keyboard_Frame();
+	int32_t  late;
+
+	if (!key->active)
+	{
+		return;
+	}
+
+	while ((late = (int32_t)((now << FRACTION_BITS) - key->due)) >= 0)
+	{
+		late >>= FRACTION_BITS;
+
+		if (USB_Keyboard_QueueSpace() >= 2)
+		{
+			Tap(key);
+			stats.taps++;
+			stats.lateSum += late;
+			if ((uint32_t)late > stats.lateMax)
+			{
+				stats.lateMax = late;
+			}
+		}
+		else
+		{
+			stats.missed++;
+		}
+
+		key->due += key->period;
+	}
+
+	Schedule(key, now);
+}
+
+// A press and a release, they reach the host in consecutive frames
+static void Tap(TurboKey *key)
+{
+	uint8_t source = HID_SOURCE_TURBO(key - turbo);
+
+	USB_Keyboard_QueueReport(source, 0, &key->usage, 1);
+	USB_Keyboard_QueueReport(source, 0, NULL, 0);
+}
+
+// Wake up in time for the next tap
+static void Schedule(TurboKey *key, uint32_t now)
+{
+	uint32_t wait = key->due - (now << FRACTION_BITS);
+
+	// Round up, a frame early would only mean waking again
+	wait = (wait + (1UL << FRACTION_BITS) - 1) >> FRACTION_BITS;
+
+	Timer_Start(&key->timer, (0 == wait) ? 1 : wait);
+}
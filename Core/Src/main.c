@@ -25,6 +25,14 @@
 #include "screen.h"
 #include "CLI.h"
 #include "usb_hid_keyboard.h"
+#include "Macro.h"
+#include "Protocol.h"
+#include "Store.h"
+#include "Library.h"
+#include "Keymap.h"
+#include "Turbo.h"
+#include "Flash.h"
+#include "Scheduler.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -80,6 +88,7 @@ static void MX_USART2_UART_Init(void);
 int main(void)
 {
   /* USER CODE BEGIN 1 */
+  Flash_Init();
 
   /* USER CODE END 1 */
 
@@ -120,6 +129,14 @@ int main(void)
 
   CLI_Init();
   ScreenInit();
+  Store_Init();
+  Library_Init();
+  Keymap_Init();
+  Turbo_Init();
+  Protocol_LoadConfig();
+  USB_Keyboard_Init();
+  Macro_Init();
+  Scheduler_Init();
 
   HAL_TIM_Encoder_Start_IT(&htim3, TIM_CHANNEL_ALL);
   ScreenUpdate();
@@ -129,10 +146,8 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
-	CLI_Update();
-
-    // Read keyboard
-	USB_Keyboard_Scan();
+	// CLI, keyboard scan, protocol and screen run as tasks, sleeping when idle
+	Scheduler_Run();
   }
   /* USER CODE END 3 */
 }
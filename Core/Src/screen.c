@@ -10,14 +10,14 @@
 ///////////////////////////////////////////////////////////////////////////////
 // Includes
 ///////////////////////////////////////////////////////////////////////////////
-#include <stdarg.h>
 #include <stdbool.h>
-#include <stdio.h>
+#include <string.h>
 
 #include "stm32f4xx_hal.h"
 
 #include "stdint.h"
 #include "CLI.h"
+#include "Format.h"
 #include "screen.h"
 #include "usb_hid_keyboard.h"
 
@@ -26,21 +26,46 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #define CLS             "\033[2J"       // Esc[2J Clear entire screen
+#define SCREEN_ROWS     24
+#define SCREEN_COLS     80
+#define MAX_GAP         4               // Unchanged cells worth resending rather than moving over
+#define RUN_SIZE        (SCREEN_COLS + 16)  // A cursor move and a run of cells
+
+#define DEFAULT_FPS     20
 
 ///////////////////////////////////////////////////////////////////////////////
 // Type definitions
 ///////////////////////////////////////////////////////////////////////////////
 
+// Formatted text written into a row of screen[][]
+typedef struct
+{
+	char	*row;
+	int		col;
+} ScreenWriter;
+
+// A cursor move and the cells after it, sent as one write
+typedef struct
+{
+	char		data[RUN_SIZE];
+	uint32_t	length;
+} RunWriter;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Private Function declarations
 ///////////////////////////////////////////////////////////////////////////////
+static bool RefreshProducer(uint32_t step);
+static void Render(void);
+static bool ScreenSink(void *context, char c);
+static bool RunSink(void *context, char c);
+static void MoveCursor(RunWriter *run, int row, int col, int newRow, int newCol);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Variable Definitions
 ///////////////////////////////////////////////////////////////////////////////
 
-// 80x24
-char screen[24][84] =
+// 80x24, what the screen should show
+char screen[SCREEN_ROWS][84] =
 {
 	//12345678901234567890123456789012345678901234567890123456789012345678901234567890
 	//         1         2         3         4         5         6         7         8
@@ -72,6 +97,21 @@ char screen[24][84] =
 	//         1         2         3         4         5         6         7         8
 };
 
+// What the terminal is showing, only the cells that differ from screen[][]
+// need to be sent
+static char     shown[SCREEN_ROWS][SCREEN_COLS];
+static uint32_t dirtyRows = 0;          // Bit per row of screen[][] written since the last flush
+static bool     refreshing = false;     // Full redraw in progress, shown[][] is not valid yet
+
+// Where the terminal cursor belongs between updates (the input line)
+static int      cursorRow = 22;
+static int      cursorCol = 4;
+
+// Frame rate limiting
+static bool     stale = true;           // Status lines need rendering again
+static uint32_t framePeriod = 1000 / DEFAULT_FPS;
+static uint32_t lastFrame = 0;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Public Function definitions
@@ -81,57 +121,341 @@ void ScreenInit(void)
 	RefreshScreen();
 }
 
-// Called by Main()
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Note that the status shown has changed, it is drawn on the next
+///          frame
+///////////////////////////////////////////////////////////////////////////////
 void ScreenUpdate(void)
 {
+	stale = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Draw anything that has changed, at most once per frame period.
+///          Called by Main()
+///////////////////////////////////////////////////////////////////////////////
+void ScreenTick(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	if ((now - lastFrame) >= framePeriod)
+	{
+		lastFrame = now;
+
+		if (stale)
+		{
+			Render();
+		}
+
+		ScreenFlush();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set the maximum number of screen updates per second
+///
+/// @param   fps - SCREEN_MIN_FPS to SCREEN_MAX_FPS
+///////////////////////////////////////////////////////////////////////////////
+void ScreenSetFrameRate(uint32_t fps)
+{
+	if ((fps >= SCREEN_MIN_FPS) && (fps <= SCREEN_MAX_FPS))
+	{
+		framePeriod = 1000 / fps;
+	}
+}
+
+uint32_t ScreenGetFrameRate(void)
+{
+	return 1000 / framePeriod;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   CLI command, show or set the frame rate
+///////////////////////////////////////////////////////////////////////////////
+int ScreenFpsCommand(int argc, char *argv[])
+{
+	int32_t fps;
+
+	if (argc > 1)
+	{
+		if (!CLI_ParseInt(argv[1], SCREEN_MIN_FPS, SCREEN_MAX_FPS, &fps))
+		{
+			return CLI_ERROR_ARGS;
+		}
+
+		ScreenSetFrameRate(fps);
+	}
+
+	Message("Screen : %u fps", ScreenGetFrameRate());
+
+	return CLI_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Write formatted text into the screen memory, it reaches the
+///          terminal on the next ScreenFlush()
+///
+/// @param   row  - 1 to 24
+/// @param   col  - 1 to 80, text is clipped at the right hand edge
+///
+/// @return  Number of characters written
+///////////////////////////////////////////////////////////////////////////////
+uint32_t ScreenVPrintAt(int row, int col, const char *format, va_list args)
+{
+	ScreenWriter writer;
+	uint32_t     length = 0;
+
+	if ((row >= 1) && (row <= SCREEN_ROWS) && (col >= 1))
+	{
+		writer.row = screen[row - 1];
+		writer.col = col - 1;
+
+		length = Format_VPrint(ScreenSink, &writer, format, args);
+		dirtyRows |= (1UL << (row - 1));
+	}
+
+	return length;
+}
+
+uint32_t ScreenPrintAt(int row, int col, const char *format, ...)
+{
+	va_list  args;
+	uint32_t length;
+
+	va_start(args, format);
+	length = ScreenVPrintAt(row, col, format, args);
+	va_end(args);
+
+	return length;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set where the cursor is left after a flush
+///////////////////////////////////////////////////////////////////////////////
+void ScreenSetCursor(int row, int col)
+{
+	cursorRow = row;
+	cursorCol = col;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Send the cells of screen[][] that differ from what the terminal
+///          shows, using the shortest cursor movement between them. Stops
+///          at the first write the output policy drops, leaving the rest
+///          dirty for the next flush.
+///////////////////////////////////////////////////////////////////////////////
+void ScreenFlush(void)
+{
+	int       row = -1;       // Terminal cursor, unknown until we move it
+	int       col = -1;
+	RunWriter run;
+
+	if (refreshing || (0 == dirtyRows))
+	{
+		return;
+	}
+
+	for (int r = 0; r < SCREEN_ROWS; r++)
+	{
+		if (0 == (dirtyRows & (1UL << r)))
+		{
+			continue;
+		}
+
+		int c = 0;
+		while (c < SCREEN_COLS)
+		{
+			if (screen[r][c] == shown[r][c])
+			{
+				c++;
+				continue;
+			}
+
+			// Run of changed cells
+			int end = c + 1;
+			while ((end < SCREEN_COLS) && (screen[r][end] != shown[r][end]))
+			{
+				end++;
+			}
+
+			// Only shown once the move and the cells have both gone
+			run.length = 0;
+			MoveCursor(&run, row, col, r, c);
+			memcpy(&run.data[run.length], &screen[r][c], end - c);
+			run.length += end - c;
+
+			if (!SendData(run.data, run.length))
+			{
+				break;
+			}
+
+			memcpy(&shown[r][c], &screen[r][c], end - c);
+
+			// Writing the last column leaves the cursor position up to the terminal
+			col = (end < SCREEN_COLS) ? end : -1;
+			row = (end < SCREEN_COLS) ? r : -1;
+			c   = end;
+		}
+
+		// Dropped, try again from here next time
+		if (c < SCREEN_COLS)
+		{
+			break;
+		}
+
+		dirtyRows &= ~(1UL << r);
+	}
+
+	// Put the cursor back on the input line
+	if ((row != cursorRow - 1) || (col != cursorCol - 1))
+	{
+		OutputAt(cursorRow, cursorCol, "");
+	}
+}
+
+void ClearScreen(void)
+{
+	Output(CLS);
+}
+
+void RefreshScreen(void)
+{
+	// About 2K of output, more than txBuffer holds, so send a row at a time.
+	// Set first, without ASYNC the producer runs and clears it straight away.
+	refreshing = true;
+	if (!CLI_StartProducer(RefreshProducer))
+	{
+		// Otherwise nothing would clear it and the screen would stop updating
+		refreshing = false;
+		Message("Output busy, screen not refreshed");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static bool RefreshProducer(uint32_t step)
+{
+	bool done = false;
+
+	if (0 == step)
+	{
+		ClearScreen();
+
+		// TODO : Remove ?
+		//	HAL_Delay(500);
+
+		// Move cursor to start od screen
+		OutputAt(1, 1, "");
+	}
+	else if (step <= SCREEN_ROWS)
+	{
+		RunWriter run = {.length = 0};
+
+		// Placed by itself, so a row lost before it can not move it
+		Format_Print(RunSink, &run, "\033[%d;1H", step);
+		memcpy(&run.data[run.length], screen[step - 1], SCREEN_COLS);
+		run.length += SCREEN_COLS;
+
+		// The terminal now matches this row, unless the write was dropped.
+		// Then no cell matches and the next flush draws it all.
+		if (SendData(run.data, run.length))
+		{
+			memcpy(shown[step - 1], screen[step - 1], SCREEN_COLS);
+			dirtyRows &= ~(1UL << (step - 1));
+		}
+		else
+		{
+			memset(shown[step - 1], 0, SCREEN_COLS);
+			dirtyRows |= (1UL << (step - 1));
+		}
+	}
+	else
+	{
+		refreshing = false;
+		stale      = true;
+		OutputAt(cursorRow, cursorCol, "");
+		done = true;
+	}
+
+	return done;
+}
+
+// Draw the status lines into screen[][]
+static void Render(void)
+{
+	stale = false;
+
 	for (int i = 0; i < NUM_KEYS; i++)
 	{
 		if (true == USB_IsKeyPressed(i))
 		{
-			OutputAt(3 + i, 12, "Down  : %d", USB_GetKeycount(i));
+			ScreenPrintAt(3 + i, 12, "Down  : %d", USB_GetKeycount(i));
 		}
 		else
 		{
-			OutputAt(3 + i, 12, "Up    : %d", USB_GetKeycount(i));
+			ScreenPrintAt(3 + i, 12, "Up    : %d", USB_GetKeycount(i));
 		}
 	}
 
-	char szBuffer[50] = {0};
 	if (TOGGLE_DIR_CLOCK == USB_GetToggDirection())
 	{
-		sprintf(szBuffer, "Clock : %d ", USB_GetTogglecount());
+		ScreenPrintAt(8, 12, "Clock : %d ", USB_GetTogglecount());
 	}
 	else
 	{
-		sprintf(szBuffer, "Anti  : %d ", USB_GetTogglecount());
+		ScreenPrintAt(8, 12, "Anti  : %d ", USB_GetTogglecount());
 	}
-	OutputAt(8, 12, szBuffer);
 }
 
-void ClearScreen(void)
+static bool ScreenSink(void *context, char c)
 {
-	Output(CLS);
+	ScreenWriter *writer = (ScreenWriter *)context;
+	bool         ret     = false;
+
+	if (writer->col < SCREEN_COLS)
+	{
+		writer->row[writer->col++] = c;
+		ret = true;
+	}
+
+	return ret;
 }
 
-void RefreshScreen(void)
+// Cheapest way from the cursor at (row, col) to (newRow, newCol), all zero
+// based, added to run
+static void MoveCursor(RunWriter *run, int row, int col, int newRow, int newCol)
 {
-	ClearScreen();
+	int gap = newCol - col;
 
-	// TODO : Remove ?
-//	HAL_Delay(500);
+	if ((row == newRow) && (gap >= 0) && (gap <= MAX_GAP))
+	{
+		// Resend the few unchanged cells in between
+		memcpy(&run->data[run->length], &screen[newRow][col], gap);
+		run->length += gap;
+	}
+	else if ((row == newRow) && (gap > 0))
+	{
+		// Esc[nC Cursor forward
+		Format_Print(RunSink, run, "\033[%dC", gap);
+	}
+	else
+	{
+		// Esc[l;cH Cursor position
+		Format_Print(RunSink, run, "\033[%d;%dH", newRow + 1, newCol + 1);
+	}
+}
 
-	// Move cursor to start od screen
-	OutputAt(1, 1, "");
+static bool RunSink(void *context, char c)
+{
+	RunWriter *run = (RunWriter *)context;
 
-	for (int i = 0; i < 24; i++)
+	if (run->length < RUN_SIZE)
 	{
-		Output(screen[i]);
+		run->data[run->length++] = c;
 	}
 
-	Prompt();
+	return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Private Function definitions
-///////////////////////////////////////////////////////////////////////////////
-
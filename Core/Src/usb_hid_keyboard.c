@@ -10,12 +10,21 @@
 // Header files
 
 #include <stdbool.h>
+#include <string.h>
 
 #include "usb_hid_keyboard.h"
 
 #include "screen.h"
 #include "main.h"
 #include "CLI.h"
+#include "Deferred.h"
+#include "Keymap.h"
+#include "Library.h"
+#include "Macro.h"
+#include "Scheduler.h"
+#include "Store.h"
+#include "Timer.h"
+#include "Turbo.h"
 #include "usbd_hid.h"
 #include "usbd_core.h"
 #include "usbd_desc.h"
@@ -44,12 +53,27 @@ typedef struct
 	uint8_t KEYCODE6;
 } keyboardHID;
 
+// What one source is holding down
+typedef struct
+{
+	uint8_t modifier;
+	uint8_t count;
+	uint8_t keycodes[6];
+} HidSource;
+
 #define KEY_1 0
 #define KEY_2 1
 #define KEY_3 2
 #define KEY_4 3
 #define KEY_R 4
 
+#define DEBOUNCE_MS 5		// A key must hold its new state this long
+
+#define REPORT_QUEUE_SIZE	16	// Power of 2
+#define REPORT_QUEUE_MASK	(REPORT_QUEUE_SIZE - 1)
+
+#define SHIFTED 0x80			// In asciiKeys[], needs MOD_LEFT_SHIFT
+
 ///////////////////////////////////////////////////////////////////////////////
 // Global Variables
 ///////////////////////////////////////////////////////////////////////////////
@@ -67,14 +91,83 @@ keyboardHID keyboardhid = {0,0,0,0,0,0,0,0};
 
 static uint16_t	toggleCount = 0;
 static uint16_t	toggleDirection = TOGGLE_DIR_CLOCK;
-static uint8_t  HID_buffer[8] = { 0 };
+static Timer    debounce[NUM_KEYS];
+
+// Presses seen by USB_Keyboard_Sample() while the scheduler was held up
+static uint32_t         sampleStart[NUM_KEYS];
+static bool             sampling[NUM_KEYS];
+static volatile bool    latched[NUM_KEYS];
+
+// Reports waiting for the IN endpoint. Filled by the macro task, emptied by
+// SendNextReport() in PendSV.
+static keyboardHID          reportQueue[REPORT_QUEUE_SIZE];
+static volatile uint32_t    reportHead = 0;
+static volatile uint32_t    reportTail = 0;
+static keyboardHID          sending;		// Owned by the endpoint until sent
+static HidSource            sources[HID_SOURCES];
+static bool                 resendPending = false;	// sources[] changed with the queue full
+
+// Pressed together they stop everything, 0 for none
+static uint8_t              panicKeys = PANIC_KEYS;
+
+// USB_Keyboard_Frame() count, carried on from the tick while not configured
+static uint32_t             frames;
+static uint16_t             lastFrame;
+static uint32_t             lastTick;
+static Deferred             sendJob;
+
+// HID usage of each printable character on a US keyboard, ' ' to '~'
+static const uint8_t        asciiKeys[] =
+{
+	44,            30 | SHIFTED,  52 | SHIFTED,  32 | SHIFTED,	//   ! " #
+	33 | SHIFTED,  34 | SHIFTED,  36 | SHIFTED,  52,			// $ % & '
+	38 | SHIFTED,  39 | SHIFTED,  37 | SHIFTED,  46 | SHIFTED,	// ( ) * +
+	54,            45,            55,            56,			// , - . /
+	39,            30,            31,            32,			// 0 1 2 3
+	33,            34,            35,            36,			// 4 5 6 7
+	37,            38,            51 | SHIFTED,  51,			// 8 9 : ;
+	54 | SHIFTED,  46,            55 | SHIFTED,  56 | SHIFTED,	// < = > ?
+	31 | SHIFTED,   4 | SHIFTED,   5 | SHIFTED,   6 | SHIFTED,	// @ A B C
+	 7 | SHIFTED,   8 | SHIFTED,   9 | SHIFTED,  10 | SHIFTED,	// D E F G
+	11 | SHIFTED,  12 | SHIFTED,  13 | SHIFTED,  14 | SHIFTED,	// H I J K
+	15 | SHIFTED,  16 | SHIFTED,  17 | SHIFTED,  18 | SHIFTED,	// L M N O
+	19 | SHIFTED,  20 | SHIFTED,  21 | SHIFTED,  22 | SHIFTED,	// P Q R S
+	23 | SHIFTED,  24 | SHIFTED,  25 | SHIFTED,  26 | SHIFTED,	// T U V W
+	27 | SHIFTED,  28 | SHIFTED,  29 | SHIFTED,  47,			// X Y Z [
+	49,            48,            35 | SHIFTED,  45 | SHIFTED,	// \ ] ^ _
+	53,             4,             5,             6,			// ` a b c
+	 7,             8,             9,            10,			// d e f g
+	11,            12,            13,            14,			// h i j k
+	15,            16,            17,            18,			// l m n o
+	19,            20,            21,            22,			// p q r s
+	23,            24,            25,            26,			// t u v w
+	27,            28,            29,            47 | SHIFTED,	// x y z {
+	49 | SHIFTED,  48 | SHIFTED,  53 | SHIFTED,					// | } ~
+};
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Local Functions
 ///////////////////////////////////////////////////////////////////////////////
 
-void USB_Keyboard_SendString(char * s);
-void USB_Keyboard_SendChar(char ch);
+static void DebounceExpired(Timer *timer);
+static void AcceptState(GPIOKEY *key, GPIO_PinState state);
+static void EncoderStep(uint8_t input);
+static void SendNextReport(void *arg);
+static void QueueMerged(void);
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set up the debounce timers, call once before scanning
+///////////////////////////////////////////////////////////////////////////////
+void USB_Keyboard_Init()
+{
+	for (int i = 0; i < NUM_KEYS; i++)
+	{
+		Timer_Init(&debounce[i], DebounceExpired, &keys[i]);
+	}
+
+	Deferred_Init(&sendJob, SendNextReport, NULL);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 /// @brief   Scan the keys, recording each of their states
@@ -86,46 +179,33 @@ void USB_Keyboard_Scan()
 
 	for (int i = 0; i < NUM_KEYS; i++)
 	{
+		// Pressed during a flash erase, maybe already let go again
+		if (latched[i])
+		{
+			latched[i]  = false;
+			sampling[i] = false;
+
+			if (GPIO_PIN_SET == keys[i].state)
+			{
+				Timer_Stop(&debounce[i]);
+				AcceptState(&keys[i], GPIO_PIN_RESET);
+			}
+		}
+
 	    state = HAL_GPIO_ReadPin(keys[i].port, keys[i].pin);
 
-	    // Has the key state changed
+	    // A change only counts once it has settled, a bounce back cancels it
 		if (state != keys[i].state)
 	    {
-			keys[i].count++;
-			keys[i].state = state;
-
-			// Send text on key up
-			if (GPIO_PIN_SET == state)
+			if (!Timer_IsActive(&debounce[i]))
 			{
-				switch (i)
-				{
-				case KEY_1:
-					USB_Keyboard_SendString("stuff");
-					break;
-
-				case KEY_2:
-					USB_Keyboard_SendString("wibble");
-					break;
-
-				case KEY_3:
-					USB_Keyboard_SendString("This is key four");
-					break;
-
-				case KEY_4:
-					USB_Keyboard_SendString("Hello World");
-					break;
-
-				case KEY_R:
-					USB_Keyboard_SendString("Rotary");
-					break;
-
-				default:
-					Message("Unknown key");
-					break;
-
-				}
+				Timer_Start(&debounce[i], DEBOUNCE_MS);
 			}
 	    }
+		else
+		{
+			Timer_Stop(&debounce[i]);
+		}
 	}
 
 	newCount = TIM3->CNT;
@@ -139,12 +219,12 @@ void USB_Keyboard_Scan()
 			if (newCount - toggleCount > 20)
 			{
 				toggleDirection = TOGGLE_DIR_CLOCK;
-				USB_Keyboard_SendString("up");
+				EncoderStep(KEYMAP_ENCODER_UP);
 			}
 			else
 			{
 				toggleDirection = TOGGLE_DIR_ANTI;
-				USB_Keyboard_SendString("down");
+				EncoderStep(KEYMAP_ENCODER_DOWN);
 			}
 		}
 		else
@@ -152,16 +232,54 @@ void USB_Keyboard_Scan()
 			if (toggleCount - newCount > 20)
 			{
 				toggleDirection = TOGGLE_DIR_ANTI;
-				USB_Keyboard_SendString("down");
+				EncoderStep(KEYMAP_ENCODER_DOWN);
 			}
 			else
 			{
 				toggleDirection = TOGGLE_DIR_CLOCK;
-				USB_Keyboard_SendString("up");
+				EncoderStep(KEYMAP_ENCODER_UP);
 			}
 		}
 
 		toggleCount = newCount;
+		ScreenUpdate();
+	}
+
+	// A change that did not fit in the queue goes as soon as there is room
+	if (resendPending && (USB_Keyboard_QueueSpace() > 0))
+	{
+		QueueMerged();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Watch for key presses while the scheduler is stopped by a flash
+///          erase. Runs from RAM, see Flash.c, and must not call anything
+///          that lives in flash. USB_Keyboard_Scan() acts on them afterwards.
+///////////////////////////////////////////////////////////////////////////////
+void USB_Keyboard_Sample(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	for (int i = 0; i < NUM_KEYS; i++)
+	{
+		if ((GPIO_PIN_SET == keys[i].state) &&
+		    (GPIO_PIN_RESET == HAL_GPIO_ReadPin(keys[i].port, keys[i].pin)))
+		{
+			if (!sampling[i])
+			{
+				sampling[i]    = true;
+				sampleStart[i] = now;
+			}
+			else if ((now - sampleStart[i]) >= DEBOUNCE_MS)
+			{
+				latched[i] = true;
+			}
+		}
+		else
+		{
+			sampling[i] = false;
+		}
 	}
 }
 
@@ -221,86 +339,307 @@ uint8_t USB_GetToggDirection()
 	return toggleDirection;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Replace or extend the macro a key plays
+///
+/// @param   key    - Macro slot, 0 to KEYMAP_MACROS - 1, see Keymap.c
+/// @param   offset - Where to write, 0 replaces the whole macro
+/// @param   code   - Macro byte code, see Macro.h
+/// @param   length - Number of bytes in code
+///
+/// @return  false if the key is unknown, the macro would not fit, or the
+///          piece belongs to an upload that has not been started
+///////////////////////////////////////////////////////////////////////////////
+bool USB_SetKeyMacro(uint8_t key, uint16_t offset, const uint8_t *code, uint16_t length)
+{
+	if (key >= KEYMAP_MACROS)
+	{
+		return false;
+	}
+
+	// Saved to the flash store once complete, keys play it from there
+	return Library_Upload(STORE_KEY_KEYMACRO(key), offset, code, length);
+}
 
-// Send character as a single key press
-void USB_Keyboard_SendChar(char ch)
+// The key has been in its new state for DEBOUNCE_MS
+static void DebounceExpired(Timer *timer)
 {
-	uint8_t ret;
+	GPIOKEY       *key   = timer->context;
+	GPIO_PinState state  = HAL_GPIO_ReadPin(key->port, key->pin);
 
-	// Check if lower or upper case
-	if(ch >= 'a' && ch <= 'z')
+	if (state != key->state)
 	{
-		HID_buffer[0] = 0;
-		// convert ch to HID letter, starting at a = 4
-		HID_buffer[2] = (uint8_t)(4 + (ch - 'a'));
+		AcceptState(key, state);
 	}
-	else if(ch >= 'A' && ch <= 'Z')
+}
+
+// A debounced change of state
+static void AcceptState(GPIOKEY *key, GPIO_PinState state)
+{
+	int i = key - keys;
+
+	uint8_t down = 0;
+
+	key->count++;
+	key->state = state;
+	ScreenUpdate();
+	Scheduler_Signal(EVENT_MACRO);
+
+	for (int k = 0; k < NUM_KEYS; k++)
 	{
-		// Add left shift
-		HID_buffer[0] = 2;
-		// convert ch to lower case
-		ch = ch - ('A'-'a');
-		// convert ch to HID letter, starting at a = 4
-		HID_buffer[2] = (uint8_t)(4 + (ch - 'a'));
+		down |= (GPIO_PIN_RESET == keys[k].state) ? (1 << k) : 0;
 	}
-	else // not a letter
+
+	// Checked before the keymap so no combo, layer or macro can hold it up.
+	// The key that completes the chord does nothing else.
+	if ((GPIO_PIN_RESET == state) && (0 != panicKeys) && (panicKeys == (down & panicKeys)))
 	{
-		switch(ch)
-		{
-			case ' ':
-				HID_buffer[2] = 44;
-				break;
-			case '.':
-				HID_buffer[2] = 55;
-				break;
-			case '\n':
-				HID_buffer[2] = 40;
-				break;
-			case '!':
-				//combination of shift modifier and key
-				HID_buffer[0] = 2;	// shift
-				HID_buffer[2] = 30; // number 1
-				break;
-			case '?':
-				//combination of shift modifier and key
-				HID_buffer[0] = 2;	// shift
-				HID_buffer[2] = 56; // key '/'
-				break;
-			default:
-				HID_buffer[2] = 0;
-		}
+		USB_Keyboard_Panic();
+		return;
 	}
 
-	// press keys
-	ret = USBD_HID_SendReport(&hUsbDeviceFS, HID_buffer, 8);
-	if(ret != HAL_OK)
+	Keymap_Event(i, GPIO_PIN_RESET == state);
+}
+
+// The encoder has moved a step, a press and release of its input
+static void EncoderStep(uint8_t input)
+{
+	Keymap_Event(input, true);
+	Keymap_Event(input, false);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set the panic chord
+///
+/// @param   keys - Bit n for key n, 0 turns it off
+///
+/// @return  false if there is no such key
+///////////////////////////////////////////////////////////////////////////////
+bool USB_SetPanicKeys(uint8_t keys)
+{
+	if (keys >= (1 << NUM_KEYS))
 	{
-		Error_Handler();
+		return false;
 	}
-	HAL_Delay(15);
 
-	// release keys
-	HID_buffer[0] = 0;
-	HID_buffer[2] = 0;
-	ret = USBD_HID_SendReport(&hUsbDeviceFS, HID_buffer, 8);
-	if(ret != HAL_OK)
+	panicKeys = keys;
+
+	return true;
+}
+
+uint8_t USB_GetPanicKeys(void)
+{
+	return panicKeys;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Stop every macro and type-through, throw away the reports still
+///          queued and put an all keys up report first in line. Called from
+///          the debounce that sees the panic chord, so it acts within
+///          DEBOUNCE_MS of the last key going down, whatever is playing.
+///////////////////////////////////////////////////////////////////////////////
+void USB_Keyboard_Panic(void)
+{
+	uint8_t stopped = Macro_Abort();
+
+	Keymap_Cancel();
+	Turbo_StopAll();
+	CLI_StopTyping();
+
+	memset(sources, 0, sizeof(sources));
+	resendPending = false;
+
+	// SendNextReport() moves reportTail from PendSV
+	__disable_irq();
+	reportTail = reportHead;
+	memset(&reportQueue[reportHead & REPORT_QUEUE_MASK], 0, sizeof(keyboardHID));
+	reportHead++;
+	__enable_irq();
+
+	Deferred_Queue(&sendJob);
+	Message("Panic, %u macros stopped", stopped);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Number of reports that can be queued right now
+///////////////////////////////////////////////////////////////////////////////
+uint32_t USB_Keyboard_QueueSpace(void)
+{
+	return REPORT_QUEUE_SIZE - (reportHead - reportTail);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   USB frames counted so far, the host's 1ms clock, so anything
+///          timed by it lines up with the frames reports go out in. The
+///          hardware only counts to 16383 so this must be called at least
+///          every 16 seconds for differences to be right. While not
+///          configured there are no frames and it counts ms instead.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t USB_Keyboard_Frame(void)
+{
+	PCD_HandleTypeDef       *hpcd = hUsbDeviceFS.pData;
+	uint32_t                USBx_BASE;
+	uint32_t                tick  = HAL_GetTick();
+	uint16_t                frame = lastFrame;
+
+	if (NULL != hpcd)
+	{
+		USBx_BASE = (uint32_t)hpcd->Instance;
+		frame     = (USBx_DEVICE->DSTS & USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos;
+	}
+
+	if ((NULL != hpcd) && (USBD_STATE_CONFIGURED == hUsbDeviceFS.dev_state))
+	{
+		frames += (uint16_t)(frame - lastFrame) & (USB_OTG_DSTS_FNSOF_Msk >> USB_OTG_DSTS_FNSOF_Pos);
+	}
+	else
+	{
+		frames += tick - lastTick;
+	}
+
+	lastFrame = frame;
+	lastTick  = tick;
+
+	return frames;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Change what one source holds down and queue a report to go to
+///          the host. The report is every source's modifiers and keys
+///          together, so sources do not let go of each other's keys. Past
+///          6 keys the later sources' keys are left out.
+///
+/// @param   source   - HID_SOURCE_xxx
+/// @param   modifier - MODIFIER byte, shift, ctrl etc
+/// @param   keycodes - HID usages of the keys held
+/// @param   count    - Number of keycodes, up to 6
+///
+/// @return  false if the queue is full. The change is still kept and goes
+///          in the next report, so a held key is never left stuck, but
+///          anything pressed and let go in between is lost.
+///////////////////////////////////////////////////////////////////////////////
+bool USB_Keyboard_QueueReport(uint8_t source, uint8_t modifier, const uint8_t *keycodes, uint8_t count)
+{
+	if (source >= HID_SOURCES)
+	{
+		return false;
+	}
+
+	sources[source].modifier = modifier;
+	sources[source].count    = (count > 6) ? 6 : count;
+	if (0 != count)
+	{
+		memcpy(sources[source].keycodes, keycodes, sources[source].count);
+	}
+
+	if (0 == USB_Keyboard_QueueSpace())
 	{
-		Error_Handler();
+		resendPending = true;
+		return false;
 	}
-	HAL_Delay(15);
+
+	QueueMerged();
+
+	return true;
 }
 
-// Send string as letters
-void USB_Keyboard_SendString(char * s)
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Translate a character into the keys that type it
+///
+/// @param   ch       - Character to type
+/// @param   modifier - Receives the modifier keys needed
+/// @param   keycode  - Receives the HID usage
+///
+/// @return  false if the character can not be typed
+///////////////////////////////////////////////////////////////////////////////
+bool USB_Keyboard_AsciiToHid(char ch, uint8_t *modifier, uint8_t *keycode)
 {
-	uint8_t i = 0;
+	uint8_t entry = 0;
+
+	if ((ch >= ' ') && (ch <= '~'))
+	{
+		entry = asciiKeys[ch - ' '];
+	}
+	else if ('\n' == ch)
+	{
+		entry = 40;		// Enter
+	}
+	else if ('\t' == ch)
+	{
+		entry = 43;		// Tab
+	}
+
+	*modifier = (entry & SHIFTED) ? MOD_LEFT_SHIFT : 0;
+	*keycode  = entry & ~SHIFTED;
 
-	while(*(s+i))
+	return (0 != entry);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Called from the OTG_FS interrupt, the IN endpoint may be free
+///////////////////////////////////////////////////////////////////////////////
+void USB_Keyboard_Interrupt(void)
+{
+	if (reportHead != reportTail)
 	{
-		USB_Keyboard_SendChar(*(s+i));
-		i++;
+		Deferred_Queue(&sendJob);
 	}
 }
 
+// Deferred job, hand the next queued report to the IN endpoint once the
+// previous one has gone
+static void SendNextReport(void *arg)
+{
+	USBD_HID_HandleTypeDef *hhid = (USBD_HID_HandleTypeDef *)hUsbDeviceFS.pClassData;
 
+	if (reportHead == reportTail)
+	{
+		return;
+	}
+
+	// Unplugged, nobody to type to
+	if ((NULL == hhid) || (USBD_STATE_CONFIGURED != hUsbDeviceFS.dev_state))
+	{
+		reportTail = reportHead;
+		Scheduler_Signal(EVENT_MACRO | EVENT_HID);
+		return;
+	}
+
+	if (HID_IDLE == hhid->state)
+	{
+		sending = reportQueue[reportTail & REPORT_QUEUE_MASK];
+		reportTail++;
+
+		USBD_HID_SendReport(&hUsbDeviceFS, (uint8_t *)&sending, sizeof(sending));
+		Scheduler_Signal(EVENT_MACRO | EVENT_HID);
+	}
+}
+
+// Queue a report of every source together, there must be room
+static void QueueMerged(void)
+{
+	keyboardHID *report;
+	uint8_t     *keycode;
+	uint8_t     used = 0;
+
+	report  = &reportQueue[reportHead & REPORT_QUEUE_MASK];
+	keycode = &report->KEYCODE1;
+	memset(report, 0, sizeof(*report));
+
+	for (uint8_t i = 0; i < HID_SOURCES; i++)
+	{
+		report->MODIFIER |= sources[i].modifier;
+
+		for (uint8_t k = 0; (k < sources[i].count) && (used < 6); k++)
+		{
+			if (NULL == memchr(keycode, sources[i].keycodes[k], used))
+			{
+				keycode[used++] = sources[i].keycodes[k];
+			}
+		}
+	}
+
+	reportHead++;
+	resendPending = false;
+	Deferred_Queue(&sendJob);
+}
@@ -78,6 +78,23 @@ LoopCopyDataInit:
   cmp r4, r1
   bcc CopyDataInit
   
+/* Copy the code that runs during flash erases into SRAM, see Flash.c */
+  ldr r0, =_sramcode
+  ldr r1, =_eramcode
+  ldr r2, =_siramcode
+  movs r3, #0
+  b LoopCopyRamCode
+
+CopyRamCode:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyRamCode:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyRamCode
+
 /* Zero fill the bss segment. */
   ldr r2, =_sbss
   ldr r4, =_ebss
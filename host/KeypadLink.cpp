@@ -0,0 +1,273 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       KeypadLink.cpp
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Host side of the binary protocol
+///
+///             Mirrors Core/Src/Protocol.c and uses the firmware's own COBS
+///             and CRC code, so the two ends cannot drift apart.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include "KeypadLink.h"
+
+extern "C"
+{
+#include "Cobs.h"
+#include "Crc16.h"
+}
+
+namespace keypad
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+static const size_t  HEADER_SIZE     = 3;		// type, seq, ack
+static const size_t  CRC_SIZE        = 2;
+static const size_t  MAX_BODY        = HEADER_SIZE + PROTOCOL_MAX_PAYLOAD + CRC_SIZE;
+static const size_t  MAX_ENCODED     = COBS_MAX_ENCODED(MAX_BODY);
+static const uint8_t FRAME_DELIMITER = 0x00;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Set up a link
+///
+/// @param   writer  - Sends bytes to the keypad
+/// @param   handler - Called with each reliable frame from the keypad, in
+///                    order and once only
+/// @param   text    - Called with CLI text between frames, may be empty
+///////////////////////////////////////////////////////////////////////////////
+Link::Link(Writer writer, Handler handler, Text text)
+	: writer(writer), handler(handler), text(text)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Send a reliable frame
+///
+/// @param   type    - MSG_xxx
+/// @param   payload - Up to PROTOCOL_MAX_PAYLOAD bytes
+/// @param   now     - ms, any free running clock
+///
+/// @return  false if the window is full or the payload too long
+///////////////////////////////////////////////////////////////////////////////
+bool Link::Send(uint8_t type, const std::vector<uint8_t> &payload, uint32_t now)
+{
+	Entry *entry;
+
+	if ((payload.size() > PROTOCOL_MAX_PAYLOAD) ||
+	    ((uint8_t)(txNext - txBase) >= PROTOCOL_WINDOW))
+	{
+		return false;
+	}
+
+	entry          = &window[txNext % PROTOCOL_WINDOW];
+	entry->type    = type;
+	entry->payload = payload;
+
+	SendFrame(type, txNext, payload, now);
+	txNext++;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Bytes read from the keypad
+///////////////////////////////////////////////////////////////////////////////
+void Link::Receive(const uint8_t *data, size_t length, uint32_t now)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		uint8_t c = data[i];
+
+		if (!inFrame)
+		{
+			if (FRAME_DELIMITER == c)
+			{
+				inFrame = true;
+				rxFrame.clear();
+			}
+			else if (text)
+			{
+				text((char)c);
+			}
+		}
+		else if (FRAME_DELIMITER == c)
+		{
+			// Back to back delimiters just restart the frame
+			if (!rxFrame.empty())
+			{
+				std::vector<uint8_t> body(rxFrame.size());
+				int32_t              decoded = -1;
+
+				if (rxFrame.size() <= MAX_ENCODED)
+				{
+					decoded = Cobs_Decode(rxFrame.data(), rxFrame.size(), body.data());
+				}
+
+				if (decoded < 0)
+				{
+					stats.badFrames++;
+				}
+				else
+				{
+					body.resize(decoded);
+					ProcessFrame(body, now);
+				}
+
+				inFrame = false;
+			}
+		}
+		else
+		{
+			rxFrame.push_back(c);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Go back N, call often with the time
+///////////////////////////////////////////////////////////////////////////////
+void Link::Poll(uint32_t now)
+{
+	if ((txBase != txNext) && ((now - txLastSend) > PROTOCOL_RETRY_MS))
+	{
+		for (uint8_t seq = txBase; seq != txNext; seq++)
+		{
+			Entry *entry = &window[seq % PROTOCOL_WINDOW];
+
+			SendFrame(entry->type, seq, entry->payload, now);
+			stats.retransmits++;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   true once everything sent has been acknowledged
+///////////////////////////////////////////////////////////////////////////////
+bool Link::Idle(void) const
+{
+	return txBase == txNext;
+}
+
+std::vector<uint8_t> Link::ConfigRead(uint8_t key)
+{
+	return {key};
+}
+
+std::vector<uint8_t> Link::ConfigWrite(uint8_t key, uint32_t value)
+{
+	return {key, (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+}
+
+// One piece of an upload, pieces of up to PROTOCOL_MAX_PAYLOAD - 3 bytes
+std::vector<uint8_t> Link::MacroWrite(uint8_t slot, uint16_t offset, const std::vector<uint8_t> &code)
+{
+	std::vector<uint8_t> payload = {slot, (uint8_t)offset, (uint8_t)(offset >> 8)};
+
+	payload.insert(payload.end(), code.begin(), code.end());
+
+	return payload;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+void Link::SendFrame(uint8_t type, uint8_t seq, const std::vector<uint8_t> &payload, uint32_t now)
+{
+	std::vector<uint8_t> body = {type, seq, rxExpected};
+	std::vector<uint8_t> encoded(MAX_ENCODED + 2);
+	uint16_t             crc;
+	uint32_t             length;
+
+	body.insert(body.end(), payload.begin(), payload.end());
+	crc = Crc16_Update(CRC16_INIT, body.data(), body.size());
+	body.push_back((uint8_t)crc);
+	body.push_back((uint8_t)(crc >> 8));
+
+	encoded[0] = FRAME_DELIMITER;
+	length     = Cobs_Encode(body.data(), body.size(), &encoded[1]) + 1;
+	encoded[length++] = FRAME_DELIMITER;
+
+	writer(encoded.data(), length);
+
+	txLastSend = now;
+	ackSent    = true;
+	stats.framesTx++;
+}
+
+void Link::ProcessFrame(const std::vector<uint8_t> &body, uint32_t now)
+{
+	size_t  length = body.size();
+	uint8_t type;
+	uint8_t seq;
+
+	if ((length < HEADER_SIZE + CRC_SIZE) ||
+	    (length > MAX_BODY) ||
+	    (Crc16_Update(CRC16_INIT, body.data(), length - CRC_SIZE) !=
+	     (uint16_t)(body[length - 2] | (body[length - 1] << 8))))
+	{
+		stats.badFrames++;
+		return;
+	}
+
+	stats.framesRx++;
+
+	type = body[0];
+	seq  = body[1];
+	ProcessAck(body[2], now);
+
+	if (MSG_ACK == type)
+	{
+		return;
+	}
+
+	if (MSG_NAK == type)
+	{
+		// Resend on the next poll
+		txLastSend = now - PROTOCOL_RETRY_MS - 1;
+		return;
+	}
+
+	if (seq != rxExpected)
+	{
+		stats.outOfOrder++;
+
+		// A repeat only needs the ack again, anything else was lost
+		SendFrame(((uint8_t)(rxExpected - seq) <= PROTOCOL_WINDOW) ? MSG_ACK : MSG_NAK, txNext, {}, now);
+		return;
+	}
+
+	rxExpected++;
+	ackSent = false;
+
+	handler(type, std::vector<uint8_t>(body.begin() + HEADER_SIZE, body.end() - CRC_SIZE));
+
+	if (!ackSent)
+	{
+		SendFrame(MSG_ACK, txNext, {}, now);
+	}
+}
+
+// The keypad has everything before ack
+void Link::ProcessAck(uint8_t ack, uint32_t now)
+{
+	uint8_t acked = (uint8_t)(ack - txBase);
+
+	if ((acked > 0) && (acked <= (uint8_t)(txNext - txBase)))
+	{
+		txBase     = ack;
+		txLastSend = now;
+	}
+}
+
+} // namespace keypad
@@ -0,0 +1,100 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       KeypadLink.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the host side of the binary protocol
+///
+///             The same frames, windowing and go back N as Core/Src/Protocol.c,
+///             see Core/Inc/Protocol.h for the format. The link does no I/O
+///             of its own, bytes go out through the Writer and come in
+///             through Receive(), and time is passed in, so it runs the same
+///             over a serial port or in a loopback test.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef KEYPAD_LINK_H_
+#define KEYPAD_LINK_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+extern "C"
+{
+#include "Protocol.h"
+}
+
+namespace keypad
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+struct LinkStats
+{
+	uint32_t	framesRx    = 0;
+	uint32_t	framesTx    = 0;
+	uint32_t	badFrames   = 0;		// COBS, length or CRC errors
+	uint32_t	outOfOrder  = 0;
+	uint32_t	retransmits = 0;
+};
+
+class Link
+{
+public:
+	using Writer  = std::function<void(const uint8_t *data, size_t length)>;
+	using Handler = std::function<void(uint8_t type, const std::vector<uint8_t> &payload)>;
+	using Text    = std::function<void(char c)>;
+
+	Link(Writer writer, Handler handler, Text text = nullptr);
+
+	bool Send(uint8_t type, const std::vector<uint8_t> &payload, uint32_t now);
+	void Receive(const uint8_t *data, size_t length, uint32_t now);
+	void Poll(uint32_t now);
+	bool Idle(void) const;
+
+	const LinkStats &Stats(void) const { return stats; }
+
+	// Payloads of the common requests, for Send()
+	static std::vector<uint8_t> ConfigRead(uint8_t key);
+	static std::vector<uint8_t> ConfigWrite(uint8_t key, uint32_t value);
+	static std::vector<uint8_t> MacroWrite(uint8_t slot, uint16_t offset, const std::vector<uint8_t> &code);
+
+private:
+	struct Entry
+	{
+		uint8_t					type;
+		std::vector<uint8_t>	payload;
+	};
+
+	void SendFrame(uint8_t type, uint8_t seq, const std::vector<uint8_t> &payload, uint32_t now);
+	void ProcessFrame(const std::vector<uint8_t> &body, uint32_t now);
+	void ProcessAck(uint8_t ack, uint32_t now);
+
+	Writer					writer;
+	Handler					handler;
+	Text					text;
+
+	// Receive side
+	bool					inFrame    = false;
+	std::vector<uint8_t>	rxFrame;
+	uint8_t					rxExpected = 0;
+
+	// Transmit side
+	Entry					window[PROTOCOL_WINDOW];
+	uint8_t					txBase     = 0;
+	uint8_t					txNext     = 0;
+	uint32_t				txLastSend = 0;
+	bool					ackSent    = false;
+
+	LinkStats				stats;
+};
+
+} // namespace keypad
+
+#endif // KEYPAD_LINK_H_
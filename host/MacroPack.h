@@ -0,0 +1,34 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       MacroPack.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the OP_PACKED encoder
+///
+///             Compresses text into the LZSS stream that Core/Src/Macro.c
+///             unpacks, see Core/Inc/Macro.h for the format.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef MACRO_PACK_H_
+#define MACRO_PACK_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace keypad
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function declarations
+///////////////////////////////////////////////////////////////////////////////
+std::vector<uint8_t> PackText(const std::string &text);
+std::vector<uint8_t> PackedInstruction(const std::string &text);
+
+} // namespace keypad
+
+#endif // MACRO_PACK_H_
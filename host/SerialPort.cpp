@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       SerialPort.cpp
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Raw Linux serial port, 115200 8N1 to match USART2
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include "SerialPort.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace keypad
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+SerialPort::~SerialPort(void)
+{
+	Close();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Open a port, e.g. /dev/ttyUSB0, in raw mode
+///
+/// @return  false if it could not be opened or set up, see errno
+///////////////////////////////////////////////////////////////////////////////
+bool SerialPort::Open(const char *path)
+{
+	struct termios tio;
+
+	Close();
+
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	if (0 != tcgetattr(fd, &tio))
+	{
+		Close();
+		return false;
+	}
+
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, B115200);
+	cfsetospeed(&tio, B115200);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~CRTSCTS;
+	tio.c_cc[VMIN]  = 0;
+	tio.c_cc[VTIME] = 0;
+
+	if (0 != tcsetattr(fd, TCSANOW, &tio))
+	{
+		Close();
+		return false;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+
+	return true;
+}
+
+void SerialPort::Close(void)
+{
+	if (fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+}
+
+bool SerialPort::Write(const uint8_t *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+
+		if (written < 0)
+		{
+			if (EINTR == errno)
+			{
+				continue;
+			}
+			return false;
+		}
+
+		data   += written;
+		length -= (size_t)written;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// @brief   Read whatever has arrived, waiting up to timeoutMs for something
+///
+/// @return  Bytes read, 0 on timeout, -1 on error
+///////////////////////////////////////////////////////////////////////////////
+long SerialPort::Read(uint8_t *data, size_t length, int timeoutMs)
+{
+	struct pollfd pfd = {fd, POLLIN, 0};
+	int           ready = poll(&pfd, 1, timeoutMs);
+
+	if (ready <= 0)
+	{
+		return ((0 == ready) || (EINTR == errno)) ? 0 : -1;
+	}
+
+	return (long)read(fd, data, length);
+}
+
+} // namespace keypad
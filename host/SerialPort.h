@@ -0,0 +1,45 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       SerialPort.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for a raw Linux serial port, 115200 8N1
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef SERIAL_PORT_H_
+#define SERIAL_PORT_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <cstddef>
+#include <cstdint>
+
+namespace keypad
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+class SerialPort
+{
+public:
+	SerialPort(void) = default;
+	~SerialPort(void);
+
+	SerialPort(const SerialPort &) = delete;
+	SerialPort &operator=(const SerialPort &) = delete;
+
+	bool Open(const char *path);
+	void Close(void);
+	bool Write(const uint8_t *data, size_t length);
+	long Read(uint8_t *data, size_t length, int timeoutMs);
+
+private:
+	int fd = -1;
+};
+
+} // namespace keypad
+
+#endif // SERIAL_PORT_H_
@@ -0,0 +1,277 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Device.c
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Stubs of the keypad under Core/Src/Protocol.c, so the real
+///             protocol code can talk to the host library without hardware
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stddef.h>
+#include <string.h>
+
+#include "Device.h"
+#include "CLI.h"
+#include "Keymap.h"
+#include "Library.h"
+#include "Scheduler.h"
+#include "Store.h"
+#include "Timer.h"
+#include "screen.h"
+#include "usb_hid_keyboard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+Device device = {0};
+
+static OutputPolicy	policy = OUTPUT_POLICY_DROP;
+static TxStats_t	txStats = {0};
+static uint8_t		panicKeys = PANIC_KEYS;
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+uint32_t HAL_GetTick(void)
+{
+	return device.tick;
+}
+
+// The UART, everything the protocol sends
+bool SendData(const char *data, uint32_t length)
+{
+	if ((device.txLength + length) > sizeof(device.tx))
+	{
+		return false;
+	}
+
+	memcpy(&device.tx[device.txLength], data, length);
+	device.txLength += length;
+
+	return true;
+}
+
+void Output(const char *format, ...)
+{
+}
+
+void Message(const char *format, ...)
+{
+	device.messages++;
+}
+
+bool CLI_ParseInt(const char *text, int32_t min, int32_t max, int32_t *value)
+{
+	return false;
+}
+
+void Scheduler_Signal(uint32_t events)
+{
+}
+
+// Nothing waits, CR_DELAY() carries straight on
+void Timer_Init(Timer *timer, TimerCallback callback, void *context)
+{
+}
+
+void Timer_Start(Timer *timer, uint32_t delay)
+{
+}
+
+void Timer_Stop(Timer *timer)
+{
+}
+
+bool Timer_IsActive(const Timer *timer)
+{
+	return false;
+}
+
+void CLI_SetOutputPolicy(OutputPolicy value)
+{
+	policy = value;
+}
+
+OutputPolicy CLI_GetOutputPolicy(void)
+{
+	return policy;
+}
+
+const TxStats_t *CLI_GetTxStats(void)
+{
+	return &txStats;
+}
+
+void ScreenSetFrameRate(uint32_t fps)
+{
+	device.fps = fps;
+}
+
+uint32_t ScreenGetFrameRate(void)
+{
+	return device.fps;
+}
+
+bool USB_SetKeyMacro(uint8_t key, uint16_t offset, const uint8_t *code, uint16_t length)
+{
+	if ((0 != key) || ((offset + length) > DEVICE_MACRO_SIZE))
+	{
+		return false;
+	}
+
+	memcpy(&device.macro[offset], code, length);
+	device.macroLength = offset + length;
+
+	return true;
+}
+
+// Each character is its own usage, so what is pressed reads back as text
+bool USB_Keyboard_AsciiToHid(char ch, uint8_t *modifier, uint8_t *keycode)
+{
+	*modifier = 0;
+	*keycode  = (uint8_t)ch;
+
+	return ('\0' != ch) && ('\r' != ch);
+}
+
+// The report queue never fills, a key is recorded as it goes down
+bool USB_Keyboard_QueueReport(uint8_t source, uint8_t modifier, const uint8_t *keycodes, uint8_t count)
+{
+	if ((count > 0) && (device.typedLength < DEVICE_TYPED_SIZE))
+	{
+		device.typed[device.typedLength++] = (char)keycodes[count - 1];
+	}
+
+	return true;
+}
+
+uint32_t USB_Keyboard_QueueSpace(void)
+{
+	return 16;
+}
+
+bool USB_IsKeyPressed(int key)
+{
+	return (1 == key);
+}
+
+int USB_GetKeycount(int key)
+{
+	return key * 10;
+}
+
+int USB_GetTogglecount()
+{
+	return 7;
+}
+
+uint8_t USB_GetToggDirection()
+{
+	return TOGGLE_DIR_CLOCK;
+}
+
+bool USB_SetPanicKeys(uint8_t keys)
+{
+	panicKeys = keys;
+	return true;
+}
+
+uint8_t USB_GetPanicKeys(void)
+{
+	return panicKeys;
+}
+
+const uint8_t *Store_Get(uint16_t key, uint16_t *length)
+{
+	return NULL;
+}
+
+void Store_Pin(const void *data)
+{
+}
+
+void Store_Unpin(const void *data)
+{
+}
+
+bool Store_Put(uint16_t key, const void *data, uint16_t length)
+{
+	device.storePuts++;
+	return true;
+}
+
+uint8_t Keymap_GetProfile(void)
+{
+	return 0;
+}
+
+bool Keymap_Load(uint8_t number)
+{
+	return (0 == number);
+}
+
+bool Keymap_SetLayer(uint8_t number, uint8_t layer, const uint8_t *actions, uint16_t length)
+{
+	return true;
+}
+
+bool Keymap_SetCombo(uint8_t number, uint8_t keys, Action action)
+{
+	return true;
+}
+
+bool Keymap_SetTapping(uint32_t term, uint8_t mode)
+{
+	return true;
+}
+
+void Keymap_GetTapping(uint32_t *term, uint8_t *mode)
+{
+	*term = KEYMAP_TAPPING_TERM;
+	*mode = 0;
+}
+
+bool Keymap_SetComboTerm(uint32_t term)
+{
+	return true;
+}
+
+uint32_t Keymap_GetComboTerm(void)
+{
+	return KEYMAP_COMBO_TERM;
+}
+
+bool Keymap_SetLeaderTimeout(uint32_t timeout)
+{
+	return true;
+}
+
+uint32_t Keymap_GetLeaderTimeout(void)
+{
+	return KEYMAP_LEADER_TIMEOUT;
+}
+
+int32_t Library_Find(const char *name)
+{
+	return LIBRARY_NONE;
+}
+
+bool Library_Play(uint16_t id)
+{
+	return false;
+}
+
+bool Library_Delete(uint16_t id)
+{
+	return false;
+}
+
+bool Library_Upload(uint16_t storeKey, uint16_t offset, const uint8_t *data, uint16_t length)
+{
+	return false;
+}
@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       Device.h
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Header file for the firmware side of the loopback test,
+///             Core/Src/Protocol.c over stubs of the rest of the keypad, and
+///             of the macro test, Core/Src/Macro.c over the same stubs
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef DEVICE_H_
+#define DEVICE_H_
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define DEVICE_MACRO_SIZE	256
+#define DEVICE_TYPED_SIZE	4096
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	uint32_t	tick;						// HAL_GetTick()
+	uint8_t		tx[4096];					// Sent by SendData(), not yet taken
+	uint32_t	txLength;
+	uint8_t		macro[DEVICE_MACRO_SIZE];	// USB_SetKeyMacro() uploads to slot 0
+	uint32_t	macroLength;
+	uint32_t	storePuts;
+	uint32_t	fps;
+	char		typed[DEVICE_TYPED_SIZE];	// Each key macros pressed, as the character
+	uint32_t	typedLength;
+	uint32_t	messages;					// Message() calls, errors and warnings
+} Device;
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+extern Device device;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEVICE_H_
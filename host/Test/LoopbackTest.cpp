@@ -0,0 +1,334 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       LoopbackTest.cpp
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      The host library against the firmware's own Protocol.c
+///
+///             Both ends run in one process on a simulated 1ms clock, joined
+///             by a channel that can drop and corrupt bytes. Checks COBS and
+///             the CRC on their own, then ping, config, macro upload and
+///             telemetry over a clean line, then everything arriving once
+///             and in order over a bad one.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+
+#include "KeypadLink.h"
+#include "Device.h"
+
+extern "C"
+{
+#include "Cobs.h"
+#include "Crc16.h"
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define CHECK(condition)	Check((condition), #condition, __LINE__)
+
+static const uint32_t RUN_LIMIT_MS = 60000;
+
+///////////////////////////////////////////////////////////////////////////////
+// Type definitions
+///////////////////////////////////////////////////////////////////////////////
+
+// One direction of the serial line
+struct Channel
+{
+	std::deque<uint8_t>	bytes;
+	uint32_t			dropOneIn    = 0;	// 0 for never
+	uint32_t			corruptOneIn = 0;
+	std::mt19937		random{1};
+
+	void Put(const uint8_t *data, size_t length)
+	{
+		for (size_t i = 0; i < length; i++)
+		{
+			uint8_t c = data[i];
+
+			if ((0 != dropOneIn) && (0 == (random() % dropOneIn)))
+			{
+				continue;
+			}
+
+			if ((0 != corruptOneIn) && (0 == (random() % corruptOneIn)))
+			{
+				c ^= (uint8_t)(1 << (random() % 8));
+			}
+
+			bytes.push_back(c);
+		}
+	}
+};
+
+struct Received
+{
+	uint8_t					type;
+	std::vector<uint8_t>	payload;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static int					failures = 0;
+static Channel				toDevice;
+static Channel				toHost;
+static std::vector<Received>	received;
+
+static keypad::Link			link(
+	[](const uint8_t *data, size_t length) { toDevice.Put(data, length); },
+	[](uint8_t type, const std::vector<uint8_t> &payload) { received.push_back({type, payload}); });
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static void Check(bool condition, const char *text, int line)
+{
+	if (!condition)
+	{
+		printf("FAIL line %d : %s\n", line, text);
+		failures++;
+	}
+}
+
+// One ms of both ends
+static void Step(void)
+{
+	device.tick++;
+
+	while (!toDevice.bytes.empty())
+	{
+		Protocol_ProcessByte(toDevice.bytes.front());
+		toDevice.bytes.pop_front();
+	}
+
+	Protocol_Update();
+
+	toHost.Put(device.tx, device.txLength);
+	device.txLength = 0;
+
+	while (!toHost.bytes.empty())
+	{
+		uint8_t c = toHost.bytes.front();
+
+		toHost.bytes.pop_front();
+		link.Receive(&c, 1, device.tick);
+	}
+
+	link.Poll(device.tick);
+}
+
+// Step until done() or the limit, false if it never happened
+template <typename Done>
+static bool Run(Done done)
+{
+	for (uint32_t ms = 0; ms < RUN_LIMIT_MS; ms++)
+	{
+		if (done())
+		{
+			return true;
+		}
+		Step();
+	}
+
+	return false;
+}
+
+// Send a request and wait for it and everything it caused to be acked
+static bool Request(uint8_t type, const std::vector<uint8_t> &payload)
+{
+	size_t before = received.size();
+
+	return link.Send(type, payload, device.tick) &&
+	       Run([before] { return (received.size() > before) && link.Idle(); });
+}
+
+static void TestCrc(void)
+{
+	const uint8_t check[] = "123456789";
+
+	// CRC-16/CCITT-FALSE check value
+	CHECK(0x29B1 == Crc16_Update(CRC16_INIT, check, 9));
+	CHECK(Crc16_Update(Crc16_Update(CRC16_INIT, check, 4), check + 4, 5) == Crc16_Update(CRC16_INIT, check, 9));
+}
+
+static void TestCobs(void)
+{
+	std::mt19937 random(2);
+
+	for (uint32_t length = 0; length < 700; length++)
+	{
+		for (int pattern = 0; pattern < 3; pattern++)
+		{
+			std::vector<uint8_t> data(length);
+			std::vector<uint8_t> encoded(COBS_MAX_ENCODED(length));
+			std::vector<uint8_t> decoded(encoded.size());
+			uint32_t             encodedLength;
+			int32_t              decodedLength;
+
+			for (uint8_t &b : data)
+			{
+				b = (0 == pattern) ? 0 : (1 == pattern) ? (uint8_t)(1 + (random() % 255)) : (uint8_t)random();
+			}
+
+			encodedLength = Cobs_Encode(data.data(), length, encoded.data());
+			CHECK(encodedLength <= COBS_MAX_ENCODED(length));
+			CHECK(nullptr == memchr(encoded.data(), 0, encodedLength));
+
+			decodedLength = Cobs_Decode(encoded.data(), encodedLength, decoded.data());
+			CHECK(decodedLength == (int32_t)length);
+			CHECK((0 == length) || (0 == memcmp(decoded.data(), data.data(), length)));
+		}
+	}
+
+	// A zero inside a block is not COBS
+	const uint8_t bad[] = {0x03, 0x01, 0x00};
+	uint8_t       out[4];
+
+	CHECK(Cobs_Decode(bad, sizeof(bad), out) < 0);
+}
+
+static void TestPing(void)
+{
+	std::vector<uint8_t> payload = {0x00, 0x01, 0x00, 0xFF, 'p', 'i', 'n', 'g'};
+
+	received.clear();
+	CHECK(Request(MSG_PING, payload));
+	CHECK((1 == received.size()) && (MSG_PONG == received[0].type) && (payload == received[0].payload));
+}
+
+static void TestConfig(void)
+{
+	received.clear();
+	CHECK(Request(MSG_CONFIG_WRITE, keypad::Link::ConfigWrite(CONFIG_SCREEN_FPS, 20)));
+	CHECK((1 == received.size()) && (MSG_CONFIG_VALUE == received[0].type));
+	CHECK(keypad::Link::ConfigWrite(CONFIG_SCREEN_FPS, 20) == received[0].payload);
+	CHECK(20 == device.fps);
+	CHECK(1 == device.storePuts);
+
+	received.clear();
+	CHECK(Request(MSG_CONFIG_READ, keypad::Link::ConfigRead(CONFIG_SCREEN_FPS)));
+	CHECK((1 == received.size()) && (keypad::Link::ConfigWrite(CONFIG_SCREEN_FPS, 20) == received[0].payload));
+
+	received.clear();
+	CHECK(Request(MSG_CONFIG_READ, keypad::Link::ConfigRead(99)));
+	CHECK((1 == received.size()) && (MSG_ERROR == received[0].type));
+	CHECK(std::vector<uint8_t>({MSG_CONFIG_READ, PROTOCOL_ERR_KEY}) == received[0].payload);
+}
+
+static void TestMacroUpload(void)
+{
+	std::vector<uint8_t> code(150);
+	const size_t         piece = PROTOCOL_MAX_PAYLOAD - 3;
+
+	// Byte code is full of zero operands
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		code[i] = (uint8_t)((i % 5) ? i : 0);
+	}
+
+	for (size_t offset = 0; offset < code.size(); offset += piece)
+	{
+		std::vector<uint8_t> part(code.begin() + offset, code.begin() + std::min(code.size(), offset + piece));
+
+		CHECK(Run([&] { return link.Send(MSG_MACRO_WRITE, keypad::Link::MacroWrite(0, (uint16_t)offset, part), device.tick); }));
+	}
+
+	CHECK(Run([] { return link.Idle(); }));
+	CHECK(code.size() == device.macroLength);
+	CHECK(0 == memcmp(code.data(), device.macro, code.size()));
+}
+
+static void TestTelemetry(void)
+{
+	size_t frames = 0;
+
+	CHECK(Request(MSG_CONFIG_WRITE, keypad::Link::ConfigWrite(CONFIG_TELEMETRY_MS, 50)));
+
+	received.clear();
+	for (int ms = 0; ms < 1000; ms++)
+	{
+		Step();
+	}
+
+	for (const Received &r : received)
+	{
+		if (MSG_TELEMETRY == r.type)
+		{
+			frames++;
+			CHECK(22 == r.payload.size());
+			CHECK(0x02 == r.payload[4]);		// Key 2 down
+		}
+	}
+
+	CHECK((frames >= 19) && (frames <= 21));
+	CHECK(Request(MSG_CONFIG_WRITE, keypad::Link::ConfigWrite(CONFIG_TELEMETRY_MS, 0)));
+}
+
+static void TestLossyLine(void)
+{
+	const uint32_t pings = 100;
+
+	toDevice.dropOneIn    = 97;
+	toDevice.corruptOneIn = 89;
+	toHost.dropOneIn      = 101;
+	toHost.corruptOneIn   = 83;
+
+	received.clear();
+	for (uint32_t n = 0; n < pings; n++)
+	{
+		std::vector<uint8_t> payload = {(uint8_t)n, 0x00, (uint8_t)~n};
+
+		CHECK(Run([&] { return link.Send(MSG_PING, payload, device.tick); }));
+	}
+
+	CHECK(Run([] { return link.Idle() && (received.size() >= pings); }));
+
+	toDevice.dropOneIn = toDevice.corruptOneIn = 0;
+	toHost.dropOneIn   = toHost.corruptOneIn   = 0;
+
+	// Every pong once, in order, nothing else
+	CHECK(pings == received.size());
+	for (uint32_t n = 0; n < received.size(); n++)
+	{
+		CHECK(MSG_PONG == received[n].type);
+		CHECK(std::vector<uint8_t>({(uint8_t)n, 0x00, (uint8_t)~n}) == received[n].payload);
+	}
+
+	CHECK(link.Stats().retransmits > 0);
+	CHECK(link.Stats().badFrames > 0);
+
+	// And the line still works once it is clean again
+	TestPing();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+	TestCrc();
+	TestCobs();
+	TestPing();
+	TestConfig();
+	TestMacroUpload();
+	TestTelemetry();
+	TestLossyLine();
+
+	printf("%s, host %u frames sent %u received %u retransmitted %u bad\n",
+	       (0 == failures) ? "Passed" : "FAILED",
+	       link.Stats().framesTx, link.Stats().framesRx, link.Stats().retransmits, link.Stats().badFrames);
+
+	return (0 == failures) ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       MacroTest.cpp
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      The host OP_PACKED encoder against the firmware's Macro.c
+///
+///             Packs text, plays it through the real interpreter over the
+///             Device.c stubs and checks every character comes back, then
+///             that copies reaching back past the start of a block are
+///             refused.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <cstdio>
+#include <random>
+#include <string>
+
+#include "MacroPack.h"
+#include "Device.h"
+
+extern "C"
+{
+#include "Macro.h"
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+#define CHECK(condition)	Check((condition), #condition, __LINE__)
+
+static const uint32_t RUN_LIMIT = 100000;		// Macro_Update() calls
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static int failures = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static void Check(bool condition, const char *text, int line)
+{
+	if (!condition)
+	{
+		printf("FAIL line %d : %s\n", line, text);
+		failures++;
+	}
+}
+
+// Play a macro to the end, returning what it typed
+static std::string Play(const std::vector<uint8_t> &code)
+{
+	device.typedLength = 0;
+	device.messages    = 0;
+
+	Macro_Init();
+	CHECK(Macro_Play(code.data(), (uint16_t)code.size(), MACRO_NO_KEY));
+
+	for (uint32_t i = 0; i < RUN_LIMIT; i++)
+	{
+		Macro_Update();
+	}
+
+	// Still playing means it never finished
+	CHECK(0 == Macro_Abort());
+
+	return std::string(device.typed, device.typedLength);
+}
+
+static void RoundTrip(const std::string &text)
+{
+	std::vector<uint8_t> code = keypad::PackedInstruction(text);
+
+	code.push_back(OP_END);
+
+	CHECK(text == Play(code));
+	CHECK(0 == device.messages);
+}
+
+static void TestRoundTrip(void)
+{
+	std::string  letter;
+	std::string  random;
+	std::mt19937 generator(3);
+
+	for (int i = 0; i < 12; i++)
+	{
+		letter += "Dear customer,\nThank you for your order " + std::to_string(1000 + (i * 37)) +
+		          ".\nIt will be with you shortly.\n\tRegards, Philtronix\n";
+	}
+
+	for (int i = 0; i < 3000; i++)
+	{
+		random += (char)('a' + (generator() % 4));
+	}
+
+	RoundTrip("");
+	RoundTrip("x");
+	RoundTrip("abc");
+	RoundTrip(std::string(1000, '='));		// Overlapping copies, past 258
+	RoundTrip("abcabcabcabcabcabcabcabcab");
+	RoundTrip(random);						// Copies reaching the whole window
+	RoundTrip(letter);
+
+	// Template text is what it is for
+	CHECK((keypad::PackText(letter).size() * 2) < letter.size());
+	printf("Letter %zu characters packed to %zu bytes\n", letter.size(), keypad::PackText(letter).size());
+}
+
+static void TestBadCopy(void)
+{
+	// A copy with nothing typed yet
+	CHECK("" == Play({OP_PACKED, 3, 0x00, 0x00, 0x00, OP_END}));
+	CHECK(1 == device.messages);
+
+	// Two back with only one typed
+	CHECK("a" == Play({OP_PACKED, 4, 0x01, 'a', 0x01, 0x00, OP_END}));
+	CHECK(1 == device.messages);
+
+	// One back is fine, and repeats the character
+	CHECK("aaaa" == Play({OP_PACKED, 4, 0x01, 'a', 0x00, 0x00, OP_END}));
+	CHECK(0 == device.messages);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+	TestRoundTrip();
+	TestBadCopy();
+
+	printf("%s\n", (0 == failures) ? "Passed" : "FAILED");
+
+	return (0 == failures) ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+///////////////////////////////////////////////////////////////////////////////
+/// @file       keypadctl.cpp
+/// @copyright  Copyright (c) Philtronix ltd - All rights Reserved
+///             Unauthorised copying of this file, via any medium is strictly
+///             prohibited.
+///
+/// @brief      Command line tool for the binary protocol
+///
+///             keypadctl <port> ping
+///             keypadctl <port> get <key>
+///             keypadctl <port> set <key> <value>
+///             keypadctl <port> macro <slot> <hex byte code>
+///             keypadctl <port> text <slot> <text to pack>
+///             keypadctl <port> telemetry <ms> <seconds>
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Includes
+///////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "KeypadLink.h"
+#include "MacroPack.h"
+#include "SerialPort.h"
+
+extern "C"
+{
+#include "Macro.h"
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Defines
+///////////////////////////////////////////////////////////////////////////////
+static const uint32_t REPLY_TIMEOUT_MS = 2000;
+static const size_t   MACRO_PIECE      = PROTOCOL_MAX_PAYLOAD - 3;	// slot(1) offset(2)
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable Definitions
+///////////////////////////////////////////////////////////////////////////////
+static keypad::SerialPort port;
+
+///////////////////////////////////////////////////////////////////////////////
+// Private Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t Now(void)
+{
+	using namespace std::chrono;
+
+	return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Run the link until done() or the timeout, false on timeout
+template <typename Done>
+static bool Pump(keypad::Link &link, uint32_t timeoutMs, Done done)
+{
+	uint32_t start = Now();
+	uint8_t  data[256];
+
+	while (!done())
+	{
+		long length = port.Read(data, sizeof(data), 10);
+
+		if (length < 0)
+		{
+			return false;
+		}
+
+		link.Receive(data, (size_t)length, Now());
+		link.Poll(Now());
+
+		if ((Now() - start) > timeoutMs)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Upload byte code in pieces, waiting for room in the window rather than fail
+static bool Upload(keypad::Link &link, uint8_t slot, const std::vector<uint8_t> &code)
+{
+	bool ok = true;
+
+	for (size_t offset = 0; ok && (offset < code.size()); offset += MACRO_PIECE)
+	{
+		std::vector<uint8_t> piece(code.begin() + offset,
+		                           code.begin() + std::min(code.size(), offset + MACRO_PIECE));
+
+		ok = Pump(link, REPLY_TIMEOUT_MS, [&] {
+			return link.Send(MSG_MACRO_WRITE, keypad::Link::MacroWrite(slot, (uint16_t)offset, piece), Now());
+		});
+	}
+
+	return ok && Pump(link, REPLY_TIMEOUT_MS, [&] { return link.Idle(); });
+}
+
+static void ShowFrame(uint8_t type, const std::vector<uint8_t> &payload)
+{
+	if ((MSG_CONFIG_VALUE == type) && (5 == payload.size()))
+	{
+		printf("config %u = %u\n", payload[0],
+		       payload[1] | (payload[2] << 8) | (payload[3] << 16) | ((uint32_t)payload[4] << 24));
+		return;
+	}
+
+	if ((MSG_ERROR == type) && (2 == payload.size()))
+	{
+		printf("error, type %02X reason %u\n", payload[0], payload[1]);
+		return;
+	}
+
+	printf("frame %02X :", type);
+	for (uint8_t b : payload)
+	{
+		printf(" %02X", b);
+	}
+	printf("\n");
+}
+
+static int Usage(void)
+{
+	fprintf(stderr, "Usage : keypadctl <port> ping\n"
+	                "        keypadctl <port> get <key>\n"
+	                "        keypadctl <port> set <key> <value>\n"
+	                "        keypadctl <port> macro <slot> <hex byte code>\n"
+	                "        keypadctl <port> text <slot> <text to pack>\n"
+	                "        keypadctl <port> telemetry <ms> <seconds>\n");
+	return 2;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Public Function definitions
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+	uint32_t replies = 0;
+	bool     ok      = false;
+
+	if (argc < 3)
+	{
+		return Usage();
+	}
+
+	if (!port.Open(argv[1]))
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	keypad::Link link(
+		[](const uint8_t *data, size_t length) { port.Write(data, length); },
+		[&replies](uint8_t type, const std::vector<uint8_t> &payload) { replies++; ShowFrame(type, payload); });
+
+	std::string command = argv[2];
+
+	if (("ping" == command) && (3 == argc))
+	{
+		ok = link.Send(MSG_PING, {'p', 'i', 'n', 'g'}, Now()) &&
+		     Pump(link, REPLY_TIMEOUT_MS, [&] { return (replies > 0) && link.Idle(); });
+	}
+	else if (("get" == command) && (4 == argc))
+	{
+		ok = link.Send(MSG_CONFIG_READ, keypad::Link::ConfigRead((uint8_t)atoi(argv[3])), Now()) &&
+		     Pump(link, REPLY_TIMEOUT_MS, [&] { return (replies > 0) && link.Idle(); });
+	}
+	else if (("set" == command) && (5 == argc))
+	{
+		ok = link.Send(MSG_CONFIG_WRITE, keypad::Link::ConfigWrite((uint8_t)atoi(argv[3]), strtoul(argv[4], nullptr, 0)), Now()) &&
+		     Pump(link, REPLY_TIMEOUT_MS, [&] { return (replies > 0) && link.Idle(); });
+	}
+	else if (("macro" == command) && (5 == argc))
+	{
+		std::vector<uint8_t> code;
+		const char           *hex = argv[4];
+
+		while (isxdigit((unsigned char)hex[0]) && isxdigit((unsigned char)hex[1]))
+		{
+			code.push_back((uint8_t)strtoul(std::string(hex, 2).c_str(), nullptr, 16));
+			hex += 2;
+		}
+
+		ok = Upload(link, (uint8_t)atoi(argv[3]), code);
+	}
+	else if (("text" == command) && (5 == argc))
+	{
+		std::vector<uint8_t> code = keypad::PackedInstruction(argv[4]);
+
+		code.push_back(OP_END);
+		ok = Upload(link, (uint8_t)atoi(argv[3]), code);
+	}
+	else if (("telemetry" == command) && (5 == argc))
+	{
+		uint32_t seconds = (uint32_t)atoi(argv[4]);
+
+		ok = link.Send(MSG_CONFIG_WRITE, keypad::Link::ConfigWrite(CONFIG_TELEMETRY_MS, (uint32_t)atoi(argv[3])), Now());
+
+		// Runs until the time is up, a timeout is the normal end
+		Pump(link, seconds * 1000, [] { return false; });
+	}
+	else
+	{
+		return Usage();
+	}
+
+	if (!ok)
+	{
+		fprintf(stderr, "No reply from the keypad\n");
+	}
+
+	return ok ? 0 : 1;
+}